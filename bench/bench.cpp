@@ -0,0 +1,310 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "argparse.hpp"
+#include "srec/crc32.hpp"
+#include "srec/hex.hpp"
+#include "srec/reader.hpp"
+#include "srec/srec.hpp"
+#include "srec/stats_alloc.hpp"
+
+extern char **environ;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+	std::string filter;
+	double min_time{0.2};   // seconds per micro-benchmark
+	size_t size{64};        // MiB of input for the tool runs
+	std::string tools;      // directory of bin2srec, srec2bin and sreccheck
+	std::string dir;        // scratch directory
+};
+
+// Work done by one iteration of a benchmark
+struct Work {
+	size_t bytes{0};   // payload bytes
+	size_t records{0}; // records, 0 if the benchmark has none
+};
+
+void report(const std::string &name, const Work &work, double seconds, size_t iterations, long allocs) {
+	const double per_iteration = seconds / static_cast<double>(iterations);
+	std::cout << std::left << std::setw(34) << name << std::right << std::fixed << std::setprecision(1);
+	if (work.bytes > 0) {
+		std::cout << std::setw(12) << static_cast<double>(work.bytes) / per_iteration / 1e6;
+	} else {
+		std::cout << std::setw(12) << "-";
+	}
+	if (work.records > 0) {
+		std::cout << std::setw(12) << per_iteration * 1e9 / static_cast<double>(work.records);
+	} else {
+		std::cout << std::setw(12) << "-";
+	}
+	if (allocs >= 0 && work.records > 0) {
+		std::cout << std::setprecision(3) << std::setw(14)
+		          << static_cast<double>(allocs) / static_cast<double>(iterations * work.records);
+	} else {
+		std::cout << std::setw(14) << "-";
+	}
+	std::cout << std::endl;
+}
+
+// Run 'body' until it took at least min_time and report the mean
+void measure(const Options &options, const std::string &name, const Work &work, const std::function<void()> &body) {
+	if (name.find(options.filter) == std::string::npos) {
+		return;
+	}
+	body(); // warm up caches and lazy initialization
+
+	size_t iterations = 1;
+	for (;;) {
+		const uint64_t allocs_before = stats::allocations();
+		const auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i) {
+			body();
+		}
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		if (seconds >= options.min_time || iterations >= (size_t(1) << 30)) {
+			report(name, work, seconds, iterations, static_cast<long>(stats::allocations() - allocs_before));
+			return;
+		}
+		iterations *= seconds > 0 ? std::clamp<size_t>(static_cast<size_t>(options.min_time / seconds * 1.2), 2, 100) : 100;
+	}
+}
+
+// Keep the compiler from dropping the result of a benchmark
+template <class T>
+void keep(const T &value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+std::vector<uint8_t> make_data(size_t size) {
+	std::vector<uint8_t> data(size);
+	uint32_t x = 0x12345678;
+	for (auto &byte : data) {
+		x = x * 1664525 + 1013904223;
+		byte = static_cast<uint8_t>(x >> 24);
+	}
+	return data;
+}
+
+const char *bits_name(SrecFile::AddressSize size) {
+	switch (size) {
+		case SrecFile::AddressSize::BITS16:
+			return "16";
+		case SrecFile::AddressSize::BITS24:
+			return "24";
+		case SrecFile::AddressSize::BITS32:
+			return "32";
+	}
+	return "?";
+}
+
+constexpr SrecFile::AddressSize ADDRESS_SIZES[] = {
+	SrecFile::AddressSize::BITS16, SrecFile::AddressSize::BITS24, SrecFile::AddressSize::BITS32
+};
+
+void bench_records(const Options &options) {
+	const std::vector<uint8_t> data = make_data(250);
+	char line[MAX_LINE_LENGTH + 1];
+
+	for (size_t length : {16, 32, 64, 128, 250}) {
+		const std::vector<uint8_t> payload(data.begin(), data.begin() + length);
+		const std::string len = std::to_string(length);
+
+		Srec3 srec(0x12345678, payload);
+		measure(options, "toString/S3/" + len, {length, 1}, [&] {
+			std::string s = srec.toString();
+			keep(s);
+		});
+		measure(options, "encode/S1/" + len, {length, 1}, [&] {
+			keep(S1Encoder::encode(0x1234, payload.data(), payload.size(), line));
+		});
+		measure(options, "encode/S3/" + len, {length, 1}, [&] {
+			keep(S3Encoder::encode(0x12345678, payload.data(), payload.size(), line));
+		});
+
+		// decoding the line written by the encoder
+		const size_t n = S3Encoder::encode(0x12345678, payload.data(), payload.size(), line);
+		const std::string text(line, n);
+		const std::string hex = text.substr(12, 2 * length);
+		uint8_t out[SrecRecord::MAX_DATA_SIZE];
+		measure(options, std::string("hex_decode/") + hex_kernel_name(hex_kernel()) + "/" + len, {length, 1}, [&] {
+			keep(hex_decode(hex, out));
+		});
+		measure(options, "parse+decode/S3/" + len, {length, 1}, [&] {
+			SrecRecord record;
+			SrecReader::parse(text, 1, record);
+			record.decode(out);
+			keep(out);
+		});
+	}
+}
+
+void bench_crc(const Options &options) {
+	const std::vector<uint8_t> data = make_data(1024 * 1024);
+	measure(options, "xcrc32/1M", {data.size(), 0}, [&] {
+		keep(xcrc32(data.data(), data.size(), 0));
+	});
+	unsigned int a = xcrc32(data.data(), data.size() / 2, 0);
+	unsigned int b = xcrc32(data.data() + data.size() / 2, data.size() / 2, 0);
+	measure(options, "crc32_combine", {0, 1}, [&] {
+		keep(crc32_combine(a, b, data.size() / 2));
+	});
+}
+
+void bench_file(const Options &options) {
+	const std::vector<uint8_t> data = make_data(16 * 1024 * 1024);
+	const std::string filename = options.dir + "/srec_bench_file.srec";
+	for (auto size : ADDRESS_SIZES) {
+		const size_t records = (data.size() + SrecFile::max_data_bytes_per_record(size) - 1)
+		                     / SrecFile::max_data_bytes_per_record(size);
+		measure(options, std::string("SrecFile::write_image/") + bits_name(size), {data.size(), records}, [&] {
+			SrecFile sf(filename, size);
+			sf.write_image(data.data(), data.size(), 0);
+			sf.write_record_count();
+			sf.write_record_termination();
+			sf.close();
+		});
+	}
+	std::remove(filename.c_str());
+}
+
+// Run a tool and wait for it, returns its exit status
+int run(const std::vector<std::string> &args) {
+	std::vector<char *> argv;
+	for (const auto &arg : args) {
+		argv.push_back(const_cast<char *>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+	pid_t pid;
+	if (::posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+		return -1;
+	}
+	int status = 0;
+	while (::waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Whole tool runs, the best of three
+void bench_tools(const Options &options) {
+	const std::string bin = options.dir + "/srec_bench.bin";
+	const std::string srec = options.dir + "/srec_bench.srec";
+	const std::string out = options.dir + "/srec_bench.out";
+	{
+		const std::vector<uint8_t> data = make_data(options.size * 1024 * 1024);
+		std::ofstream f(bin, std::ios::binary);
+		f.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+	}
+	const size_t bytes = options.size * 1024 * 1024;
+
+	auto tool = [&](const std::string &name, const Work &work, const std::vector<std::string> &args) {
+		if (name.find(options.filter) == std::string::npos) {
+			return;
+		}
+		double best = 0;
+		for (int i = 0; i < 3; ++i) {
+			const auto start = Clock::now();
+			if (run(args) != 0) {
+				std::cerr << name << ": " << args[0] << " failed" << std::endl;
+				return;
+			}
+			const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			best = i == 0 ? seconds : std::min(best, seconds);
+		}
+		report(name, work, best, 1, -1);
+	};
+
+	for (auto size : ADDRESS_SIZES) {
+		const std::string bits = bits_name(size);
+		const Work work{bytes, (bytes + SrecFile::max_data_bytes_per_record(size) - 1) / SrecFile::max_data_bytes_per_record(size)};
+		tool("bin2srec/" + bits, work, {options.tools + "/bin2srec", "-i", bin, "-o", srec, "-b", bits, "-c"});
+		tool("bin2srec -j 1/" + bits, work, {options.tools + "/bin2srec", "-i", bin, "-o", srec, "-b", bits, "-c", "-j", "1"});
+		// make sure the file exists for the other tools, even if filtered out
+		if (run({options.tools + "/bin2srec", "-i", bin, "-o", srec, "-b", bits, "-c"}) != 0) {
+			std::cerr << "bin2srec failed, skipping the tool runs" << std::endl;
+			break;
+		}
+		// 16 bit addresses wrap after 64 KiB, which srec2bin rejects as overlapping
+		if (size != SrecFile::AddressSize::BITS16) {
+			tool("srec2bin/" + bits, work, {options.tools + "/srec2bin", "-i", srec, "-o", out});
+		}
+		tool("sreccheck/" + bits, work, {options.tools + "/sreccheck", srec});
+	}
+	std::remove(bin.c_str());
+	std::remove(srec.c_str());
+	std::remove(out.c_str());
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	argparse::ArgumentParser program("srec_bench");
+	program.add_argument("-f", "--filter")
+		.help("Only run benchmarks whose name contains this text")
+		.default_value(std::string());
+	program.add_argument("-t", "--min-time")
+		.help("Seconds to run every micro-benchmark")
+		.default_value(0.2)
+		.nargs(1)
+		.scan<'g', double>();
+	program.add_argument("-s", "--size")
+		.help("MiB of input for the tool runs")
+		.default_value(64)
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("--tools")
+		.help("Directory of bin2srec, srec2bin and sreccheck, empty skips the tool runs")
+		.default_value(std::string(SREC_TOOLS_DIR));
+	program.add_argument("--dir")
+		.help("Directory for scratch files")
+		.default_value(std::string("/tmp"));
+
+	try {
+		program.parse_args(argc, argv);
+	} catch (const std::exception &err) {
+		std::cerr << "Parsing command line arguments failed" << std::endl;
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	Options options;
+	options.filter = program.get<std::string>("--filter");
+	options.min_time = program.get<double>("--min-time");
+	options.size = static_cast<size_t>(std::max(1, program.get<int>("--size")));
+	options.tools = program.get<std::string>("--tools");
+	options.dir = program.get<std::string>("--dir");
+
+	std::cout << std::left << std::setw(34) << "BENCHMARK" << std::right << std::setw(12) << "MB/s"
+	          << std::setw(12) << "ns/record" << std::setw(14) << "allocs/record" << std::endl;
+	try {
+		bench_records(options);
+		bench_crc(options);
+		bench_file(options);
+		if (!options.tools.empty()) {
+			bench_tools(options);
+		}
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
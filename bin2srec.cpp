@@ -2,79 +2,89 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "argparse.hpp"
 
 #include "srec/srec.hpp"
 #include "srec/crc32.hpp"
+#include "srec/mapped.hpp"
+#include "srec/pipeline.hpp"
+#include "srec/stats.hpp"
+#include "srec/writer.hpp"
+
+void convert_bin_to_srec(int input, SrecFile &sfile, bool want_checksum, unsigned int jobs);
 
-void convert_bin_to_srec(std::ifstream &input, SrecFile &sfile, bool want_checksum);
-void write_checksum(const SrecFile &srecfile, const unsigned int sum);
+// Records of one input block, encoded by a pipeline worker
+struct EncodedBlock {
+	std::vector<char> text;
+	size_t records{0};
+	size_t length{0};
+	unsigned int crc{0};
+};
 
 // Convert a binary file to an Srecord file
-void convert_bin_to_srec(std::ifstream &input, SrecFile &sfile, bool want_checksum) {
-	// Get the max number the Srecord can store
-	int bytes_to_read = sfile.max_data_bytes_per_record();
-	// Buffer to store data from input file
-	std::vector<uint8_t> buffer(bytes_to_read);
+// The input is read in fixed size blocks, so memory use does not
+// depend on its size and it can be a pipe. One thread reads, 'jobs'
+// threads encode and this one writes, all at the same time.
+void convert_bin_to_srec(int input, SrecFile &sfile, bool want_checksum, unsigned int jobs) {
+	// Read whole records at a time so the record layout does not depend on the block size
+	const size_t block_size = sfile.max_data_bytes_per_record() * 1024;
+	const SrecFile::AddressSize address_size = sfile.addrsize();
 
 	// CRC32 checksum
 	unsigned int sum = 0;
 
-	// Read input file and write to Srecord file
-	while (input.read(reinterpret_cast<char*>(buffer.data()), buffer.size()) || input.gcount() > 0) {
-		// resize buffer in case the last read was less than the 'bytes_to_read'
-		buffer.resize(input.gcount());
+	// Reserve the checksum as the first line in the Srecord file,
+	// it is filled in once all data has been written. A stream cannot
+	// be rewritten, there it follows the data instead.
+	const bool crc_header = want_checksum && sfile.seekable();
+	if (crc_header) {
+		sfile.reserve_crc_header();
+	}
 
-		sfile.write_record_payload(buffer);
-		sum = xcrc32(buffer.data(), buffer.size(), sum);
-		buffer.resize(bytes_to_read);
+	// Read input file and write to Srecord file
+	BlockPipeline<EncodedBlock> pipeline(block_size, BlockPipeline<EncodedBlock>::Split::Bytes, jobs);
+	pipeline.run(input, {}, [address_size](const char *data, size_t length, uint64_t offset) {
+		const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+		EncodedBlock block;
+		{
+			SREC_STATS_TIME_BYTES(Encode, length);
+			block.text.resize(encoded_image_size(address_size, length));
+			block.records = encode_image(address_size, bytes, length, static_cast<unsigned int>(offset), block.text.data());
+		}
+		block.length = length;
+		SREC_STATS_TIME_BYTES(Crc, length);
+		block.crc = xcrc32(bytes, length, 0);
+		return block;
+	}, [&sfile, &sum](EncodedBlock &block) {
+		sfile.write_lines(block.text.data(), block.text.size(), static_cast<unsigned int>(block.records), block.length);
+		sum = crc32_combine(sum, block.crc, block.length);
+	});
+
+	if (want_checksum && !crc_header) {
+		sfile.write_crc_record(sum);
 	}
 
 	// Write record count and termination
 	sfile.write_record_count();
 	sfile.write_record_termination();
 
-	sfile.close();
-	// bfile.close();
-	input.close();
-
-	// Write checksum if requested as the first line in the Srecord file
-	if (want_checksum) {
-		write_checksum(sfile, sum);
+	if (crc_header) {
+		sfile.write_crc_header(sum);
 	}
-}
-
-void write_checksum(const SrecFile &srecfile, const unsigned int sum) {
-	// Open a temp file
-	std::string tempfilename = srecfile.getFilename() + ".tmp";
-	SrecFile sfile(tempfilename, srecfile.addrsize());
-	if (!sfile.is_open()) {
-		std::cerr << "Error opening output file" << std::endl;
-		throw std::ios_base::failure("Error opening output file: " + tempfilename);
-	}
-
-	// Convert crc32 to byte vector
-	std::vector<uint8_t> crc32bytes;
-	crc32bytes.push_back((sum >> 24) & 0xFF);
-	crc32bytes.push_back((sum >> 16) & 0xFF);
-	crc32bytes.push_back((sum >> 8) & 0xFF);
-	crc32bytes.push_back(sum & 0xFF);
-	crc32bytes.push_back(0); // null
 
-	// Write header
-	sfile.write_header(crc32bytes);
 	sfile.close();
+}
 
-	// Now append the original file to the temp file
-	std::ifstream ifs(srecfile.getFilename(), std::ios::binary);
-	std::ofstream ofs(tempfilename, std::ios::binary | std::ios::app);
-	ofs << ifs.rdbuf();
-	ifs.close();
-	ofs.close();
-
-	// Rename the temp file to the original file
-	std::rename(tempfilename.c_str(), srecfile.getFilename().c_str());
+// The parallel writer needs a regular output file it can size and map
+bool output_mappable(const std::string &filename) {
+	struct stat st{};
+	return filename != "-" && (::stat(filename.c_str(), &st) != 0 || S_ISREG(st.st_mode));
 }
 
 int main(int argc, char *argv[]) {
@@ -84,9 +94,9 @@ int main(int argc, char *argv[]) {
 	// Define arguments
 	argparse::ArgumentParser parser("bin2srec");
 	parser.add_argument("-i", "--input")
-		.help("Input file name");
+		.help("Input file name, - for stdin");
 	parser.add_argument("-o", "--output")
-		.help("Output file name")
+		.help("Output file name, - for stdout")
 		.default_value("output.srec");
 	parser.add_argument("-b", "--addrbits")
 		.help("Address bits, 16, 24, or 32")
@@ -94,7 +104,35 @@ int main(int argc, char *argv[]) {
 		.nargs(1)
 		.scan<'i', int>();
 	parser.add_argument("-c", "--checksum")
-		.help("Add a CRC32 checksum as the first S0 record")
+		.help("Add a CRC32 checksum as the first S0 record, or after the data when writing to a stream")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("-s", "--sync")
+		.help("Sync the output file to disk before exiting")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("-j", "--jobs")
+		.help("Number of threads used to encode the output, 0 uses all cores")
+		.default_value(0)
+		.nargs(1)
+		.scan<'i', int>();
+	parser.add_argument("--io-depth")
+		.help("Output writes kept in flight when converting a stream, using io_uring where available")
+		.default_value(0)
+		.nargs(1)
+		.scan<'i', int>();
+	parser.add_argument("--stats")
+		.help("Print the time of each phase and counters of the run to stderr")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--stats-json")
+		.help("Like --stats, as JSON")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--trace")
+		.help("Write a Chrome trace-event JSON file of the phases of every thread");
+	parser.add_argument("--perf")
+		.help("Count CPU cycles, instructions, cache and branch misses of every phase, printed like --stats")
 		.default_value(false)
 		.implicit_value(true);
 
@@ -108,6 +146,19 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	// Reported when main() returns, however the run ends
+	stats::Session stats_session;
+	if (parser.get<bool>("--stats") || parser.get<bool>("--stats-json")) {
+		stats_session.report(parser.get<bool>("--stats-json") ? stats::Format::Json : stats::Format::Table);
+	}
+	if (auto trace = parser.present("--trace")) {
+		stats_session.trace(*trace);
+	}
+	if (parser.get<bool>("--perf")) {
+		stats_session.perf();
+	}
+	stats_session.start();
+
 	// Check if input file is specified
 	try {
 		inputfilename = parser.get<std::string>("--input");
@@ -126,13 +177,6 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	// Open input file
-	std::ifstream input(inputfilename, std::ios::binary);
-	if (!input.is_open()) {
-		std::cerr << "Error opening input file" << std::endl;
-		return 1;
-	}
-
 	// Get address size
 	SrecFile::AddressSize addrsize;
 	switch (parser.get<int>("--addrbits")) {
@@ -150,14 +194,57 @@ int main(int argc, char *argv[]) {
 			return 1;
 	}
 
+	// Regular files are mapped and encoded on all threads straight into the output
+	const int jobs = parser.get<int>("--jobs");
+	if (jobs < 0) {
+		std::cerr << "Invalid number of jobs" << std::endl;
+		return 1;
+	}
+	if (jobs != 1 && inputfilename != "-" && MappedFile::mappable(inputfilename) && output_mappable(outputfilename)) {
+		try {
+			MappedFile input(inputfilename);
+			ParallelWriteOptions options;
+			options.checksum = parser.get<bool>("--checksum");
+			options.sync = parser.get<bool>("--sync");
+			options.threads = jobs;
+			write_srec_parallel(outputfilename, addrsize, input.data(), input.size(), options);
+		} catch (const std::exception &err) {
+			std::cerr << err.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// Open input file, "-" is stdin
+	int input = inputfilename == "-" ? STDIN_FILENO : ::open(inputfilename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (input < 0) {
+		std::cerr << "Error opening input file" << std::endl;
+		return 1;
+	}
+
 	// Open output file
 	SrecFile sfile(outputfilename, addrsize);
 	if (!sfile.is_open()) {
 		std::cerr << "Error opening output file" << std::endl;
 		return 1;
 	}
+	sfile.set_sync_on_close(parser.get<bool>("--sync"));
+	const int io_depth = parser.get<int>("--io-depth");
+	if (io_depth < 0) {
+		std::cerr << "Invalid I/O depth" << std::endl;
+		return 1;
+	}
 
-	convert_bin_to_srec(input, sfile, parser.get<bool>("--checksum"));
+	try {
+		sfile.set_io_depth(io_depth);
+		convert_bin_to_srec(input, sfile, parser.get<bool>("--checksum"), jobs);
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
+	if (input != STDIN_FILENO) {
+		::close(input);
+	}
 
 	return 0;
 }
@@ -0,0 +1,537 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <ios>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// io_uring is used through its system calls, so no liburing is needed
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define SREC_HAVE_IO_URING 1
+#endif
+#endif
+
+#include "aio.hpp"
+#include "stats.hpp"
+
+namespace {
+
+// One read or write, kept until its completion is returned
+struct Request {
+	bool write{false};
+	int fd{-1};
+	char *data{nullptr};
+	size_t length{0};
+	uint64_t offset{0};
+	uint64_t tag{0};
+	size_t done{0}; // bytes already transferred
+	iovec iov{};    // for the vectored io_uring operations
+};
+
+// Run a request to the end with pread()/pwrite(), returns the bytes
+// transferred or -errno
+ssize_t transfer(Request &request) {
+	while (request.done < request.length) {
+		char *data = request.data + request.done;
+		const size_t length = request.length - request.done;
+		const off_t offset = static_cast<off_t>(request.offset + request.done);
+		ssize_t n = request.write ? ::pwrite(request.fd, data, length, offset)
+		                          : ::pread(request.fd, data, length, offset);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (n == 0) {
+			if (request.write) {
+				return -EIO;
+			}
+			break; // end of file
+		}
+		request.done += n;
+	}
+	return static_cast<ssize_t>(request.done);
+}
+
+} // namespace
+
+struct AsyncIo::Impl {
+	Backend backend{Backend::Portable};
+	unsigned int depth;
+	std::vector<Request> requests;
+	std::vector<unsigned int> free_slots;
+	std::vector<unsigned int> queued; // portable: slots waiting for submit()
+	std::deque<std::pair<unsigned int, ssize_t>> completed; // portable: slots finished on submit()
+	size_t in_flight{0};
+
+	std::vector<iovec> buffers;
+	std::vector<int> files;
+
+#ifdef SREC_HAVE_IO_URING
+	int ring{-1};
+	void *sq_map{nullptr};
+	size_t sq_map_size{0};
+	void *cq_map{nullptr};
+	size_t cq_map_size{0};
+	io_uring_sqe *sqes{nullptr};
+	size_t sqes_size{0};
+	unsigned int *sq_head{nullptr};
+	unsigned int *sq_tail{nullptr};
+	unsigned int *sq_mask{nullptr};
+	unsigned int *sq_array{nullptr};
+	unsigned int *cq_head{nullptr};
+	unsigned int *cq_tail{nullptr};
+	unsigned int *cq_mask{nullptr};
+	io_uring_cqe *cqes{nullptr};
+	unsigned int to_submit{0}; // entries added to the ring since the last io_uring_enter
+	bool fixed_buffers{false};
+	bool fixed_files{false};
+
+	bool setup();
+	void unmap();
+	void push(unsigned int slot);
+	void enter(unsigned int min_complete);
+	size_t reap(std::vector<Completion> &out);
+#endif
+
+	explicit Impl(unsigned int depth) : depth(depth), requests(depth) {
+		for (unsigned int i = depth; i > 0; --i) {
+			free_slots.push_back(i - 1);
+		}
+	}
+
+	void queue(bool write, int fd, const void *data, size_t length, uint64_t offset, uint64_t tag);
+	void release(unsigned int slot, ssize_t result, std::vector<Completion> &out) {
+		out.push_back({requests[slot].tag, result});
+		free_slots.push_back(slot);
+		in_flight--;
+	}
+};
+
+#ifdef SREC_HAVE_IO_URING
+
+// Set up the rings, returns false if the kernel does not support io_uring
+bool AsyncIo::Impl::setup() {
+	io_uring_params params{};
+	ring = static_cast<int>(::syscall(__NR_io_uring_setup, depth, &params));
+	if (ring < 0) {
+		return false;
+	}
+	::fcntl(ring, F_SETFD, FD_CLOEXEC);
+
+	sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+	}
+	sq_map = ::mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (sq_map == MAP_FAILED) {
+		sq_map = nullptr;
+		unmap();
+		return false;
+	}
+	if (single) {
+		cq_map = sq_map;
+	} else {
+		cq_map = ::mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if (cq_map == MAP_FAILED) {
+			cq_map = nullptr;
+			unmap();
+			return false;
+		}
+	}
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqe_map = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (sqe_map == MAP_FAILED) {
+		unmap();
+		return false;
+	}
+	sqes = static_cast<io_uring_sqe *>(sqe_map);
+
+	char *sq = static_cast<char *>(sq_map);
+	sq_head = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+	char *cq = static_cast<char *>(cq_map);
+	cq_head = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	return true;
+}
+
+void AsyncIo::Impl::unmap() {
+	if (sqes != nullptr) {
+		::munmap(sqes, sqes_size);
+	}
+	if (cq_map != nullptr && cq_map != sq_map) {
+		::munmap(cq_map, cq_map_size);
+	}
+	if (sq_map != nullptr) {
+		::munmap(sq_map, sq_map_size);
+	}
+	sqes = nullptr;
+	sq_map = cq_map = nullptr;
+	if (ring >= 0) {
+		::close(ring);
+		ring = -1;
+	}
+}
+
+// Add the rest of a request to the submission ring
+void AsyncIo::Impl::push(unsigned int slot) {
+	Request &request = requests[slot];
+	const unsigned int tail = *sq_tail;
+	const unsigned int index = tail & *sq_mask;
+	io_uring_sqe *sqe = &sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+
+	char *data = request.data + request.done;
+	const size_t length = request.length - request.done;
+	sqe->off = request.offset + request.done;
+	sqe->user_data = slot;
+
+	auto buffer = std::find_if(buffers.begin(), buffers.end(), [&](const iovec &b) {
+		const char *base = static_cast<const char *>(b.iov_base);
+		return fixed_buffers && data >= base && data + length <= base + b.iov_len;
+	});
+	if (buffer != buffers.end()) {
+		sqe->opcode = request.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = reinterpret_cast<uintptr_t>(data);
+		sqe->len = static_cast<uint32_t>(length);
+		sqe->buf_index = static_cast<uint16_t>(buffer - buffers.begin());
+	} else {
+		// the vectored operations work on every kernel with io_uring
+		request.iov = {data, length};
+		sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = reinterpret_cast<uintptr_t>(&request.iov);
+		sqe->len = 1;
+	}
+	auto file = std::find(files.begin(), files.end(), request.fd);
+	if (fixed_files && file != files.end()) {
+		sqe->fd = static_cast<int>(file - files.begin());
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = request.fd;
+	}
+
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+}
+
+// Submit the new entries and wait for 'min_complete' completions
+void AsyncIo::Impl::enter(unsigned int min_complete) {
+	for (;;) {
+		const unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+		long n = ::syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, nullptr, 0);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::ios_base::failure("io_uring_enter failed: " + std::string(std::strerror(errno)));
+		}
+		to_submit -= std::min<unsigned int>(to_submit, static_cast<unsigned int>(n));
+		return;
+	}
+}
+
+// Take the completions off the ring, continuing short transfers
+size_t AsyncIo::Impl::reap(std::vector<Completion> &out) {
+	size_t count = 0;
+	unsigned int head = *cq_head;
+	const unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const io_uring_cqe &cqe = cqes[head & *cq_mask];
+		const auto slot = static_cast<unsigned int>(cqe.user_data);
+		Request &request = requests[slot];
+		const int res = cqe.res;
+		if (res == -EINTR || res == -EAGAIN) {
+			push(slot);
+			continue;
+		}
+		if (res < 0) {
+			release(slot, res, out);
+		} else if (res == 0) {
+			release(slot, request.write ? -EIO : static_cast<ssize_t>(request.done), out);
+		} else {
+			request.done += res;
+			if (request.done < request.length) {
+				push(slot);
+				continue;
+			}
+			release(slot, static_cast<ssize_t>(request.done), out);
+		}
+		count++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+#endif
+
+void AsyncIo::Impl::queue(bool write, int fd, const void *data, size_t length, uint64_t offset, uint64_t tag) {
+	if (free_slots.empty()) {
+		throw std::logic_error("I/O queue is full");
+	}
+	const unsigned int slot = free_slots.back();
+	free_slots.pop_back();
+	in_flight++;
+
+	Request &request = requests[slot];
+	request.write = write;
+	request.fd = fd;
+	request.data = static_cast<char *>(const_cast<void *>(data));
+	request.length = length;
+	request.offset = offset;
+	request.tag = tag;
+	request.done = 0;
+
+#ifdef SREC_HAVE_IO_URING
+	if (backend == Backend::IoUring) {
+		push(slot);
+		return;
+	}
+#endif
+	queued.push_back(slot);
+}
+
+AsyncIo::AsyncIo(unsigned int depth, Backend backend) {
+	if (depth == 0) {
+		throw std::invalid_argument("Queue depth must not be zero");
+	}
+	impl = std::make_unique<Impl>(depth);
+#ifdef SREC_HAVE_IO_URING
+	if (backend != Backend::Portable && impl->setup()) {
+		impl->backend = Backend::IoUring;
+		return;
+	}
+#endif
+	if (backend == Backend::IoUring) {
+		throw std::ios_base::failure("io_uring is not available");
+	}
+}
+
+AsyncIo::~AsyncIo() {
+	// The kernel may still write into the buffers of requests in flight
+	try {
+		std::vector<Completion> done;
+		while (impl->in_flight > 0) {
+			wait(done, impl->in_flight);
+		}
+	} catch (const std::exception &) {
+		// closing the ring below cancels what is left
+	}
+#ifdef SREC_HAVE_IO_URING
+	impl->unmap();
+#endif
+}
+
+AsyncIo::Backend AsyncIo::backend() const {
+	return impl->backend;
+}
+
+const char *AsyncIo::backend_name(Backend backend) {
+	switch (backend) {
+		case Backend::Auto:
+			return "auto";
+		case Backend::IoUring:
+			return "io_uring";
+		case Backend::Portable:
+			return "pread/pwrite";
+	}
+	return "unknown";
+}
+
+unsigned int AsyncIo::depth() const {
+	return impl->depth;
+}
+
+size_t AsyncIo::in_flight() const {
+	return impl->in_flight;
+}
+
+void AsyncIo::register_buffers(const std::vector<iovec> &buffers) {
+	if (impl->in_flight > 0) {
+		throw std::logic_error("Cannot register buffers with requests in flight");
+	}
+	impl->buffers = buffers;
+#ifdef SREC_HAVE_IO_URING
+	if (impl->backend == Backend::IoUring) {
+		if (impl->fixed_buffers) {
+			::syscall(__NR_io_uring_register, impl->ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		}
+		impl->fixed_buffers = !buffers.empty() && ::syscall(__NR_io_uring_register, impl->ring, IORING_REGISTER_BUFFERS,
+		                                                    buffers.data(), static_cast<unsigned int>(buffers.size())) == 0;
+	}
+#endif
+}
+
+void AsyncIo::register_files(const std::vector<int> &fds) {
+	if (impl->in_flight > 0) {
+		throw std::logic_error("Cannot register files with requests in flight");
+	}
+	impl->files = fds;
+#ifdef SREC_HAVE_IO_URING
+	if (impl->backend == Backend::IoUring) {
+		if (impl->fixed_files) {
+			::syscall(__NR_io_uring_register, impl->ring, IORING_UNREGISTER_FILES, nullptr, 0);
+		}
+		impl->fixed_files = !fds.empty() && ::syscall(__NR_io_uring_register, impl->ring, IORING_REGISTER_FILES,
+		                                              fds.data(), static_cast<unsigned int>(fds.size())) == 0;
+	}
+#endif
+}
+
+void AsyncIo::read(int fd, void *data, size_t length, uint64_t offset, uint64_t tag) {
+	impl->queue(false, fd, data, length, offset, tag);
+}
+
+void AsyncIo::write(int fd, const void *data, size_t length, uint64_t offset, uint64_t tag) {
+	impl->queue(true, fd, data, length, offset, tag);
+}
+
+void AsyncIo::submit() {
+#ifdef SREC_HAVE_IO_URING
+	if (impl->backend == Backend::IoUring) {
+		if (impl->to_submit > 0) {
+			impl->enter(0);
+		}
+		return;
+	}
+#endif
+	for (unsigned int slot : impl->queued) {
+		impl->completed.emplace_back(slot, transfer(impl->requests[slot]));
+	}
+	impl->queued.clear();
+}
+
+size_t AsyncIo::wait(std::vector<Completion> &out, size_t min) {
+	min = std::min(min, impl->in_flight);
+#ifdef SREC_HAVE_IO_URING
+	if (impl->backend == Backend::IoUring) {
+		size_t count = impl->reap(out);
+		while (count < min || impl->to_submit > 0) {
+			impl->enter(count < min ? static_cast<unsigned int>(min - count) : 0);
+			count += impl->reap(out);
+		}
+		return count;
+	}
+#endif
+	submit();
+	const size_t count = impl->completed.size();
+	for (const auto &completion : impl->completed) {
+		impl->release(completion.first, completion.second, out);
+	}
+	impl->completed.clear();
+	return count;
+}
+
+void read_files(const std::vector<std::string> &filenames,
+                const std::function<void(size_t index, std::vector<char> &data, std::exception_ptr error)> &handler,
+                unsigned int depth, AsyncIo::Backend backend) {
+	struct File {
+		int fd{-1};
+		std::vector<char> data;
+	};
+	std::vector<File> files(filenames.size());
+	AsyncIo io(depth, backend);
+
+	auto finish = [&](size_t index) {
+		::close(files[index].fd);
+		files[index] = File();
+	};
+
+	// Open a file and queue its read, returns false if it was handled right away
+	auto start = [&](size_t index) {
+		const std::string &filename = filenames[index];
+		File &file = files[index];
+		try {
+			file.fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+			if (file.fd < 0) {
+				throw std::ios_base::failure("Failed to open file: " + filename);
+			}
+			struct stat st{};
+			if (::fstat(file.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+				throw std::ios_base::failure("Not a regular file: " + filename);
+			}
+			if (st.st_size > 0) {
+				file.data.resize(st.st_size);
+				io.read(file.fd, file.data.data(), file.data.size(), 0, index);
+				return true;
+			}
+		} catch (const std::ios_base::failure &) {
+			if (file.fd >= 0) {
+				finish(index);
+			}
+			std::vector<char> none;
+			handler(index, none, std::current_exception());
+			return false;
+		}
+		finish(index);
+		handler(index, file.data, nullptr);
+		return false;
+	};
+
+	std::vector<AsyncIo::Completion> done;
+	size_t next = 0;
+	try {
+		while (next < filenames.size() || io.in_flight() > 0) {
+			while (next < filenames.size() && !io.full()) {
+				start(next++);
+			}
+			if (io.in_flight() == 0) {
+				continue;
+			}
+			done.clear();
+			io.wait(done);
+			for (const auto &completion : done) {
+				const size_t index = completion.tag;
+				std::exception_ptr error;
+				std::vector<char> &data = files[index].data;
+				if (completion.result < 0) {
+					error = std::make_exception_ptr(std::ios_base::failure(
+						"Failed to read file: " + filenames[index] + ": " + std::strerror(static_cast<int>(-completion.result))));
+					data.clear();
+				} else {
+					// the file may have shrunk since it was sized
+					data.resize(completion.result);
+					SREC_STATS_ADD(BytesIn, completion.result);
+				}
+				try {
+					handler(index, data, error);
+				} catch (...) {
+					finish(index);
+					throw;
+				}
+				finish(index);
+			}
+		}
+	} catch (...) {
+		// let the reads in flight finish before their buffers go away
+		while (io.in_flight() > 0) {
+			done.clear();
+			io.wait(done, io.in_flight());
+		}
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (files[i].fd >= 0) {
+				finish(i);
+			}
+		}
+		throw;
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef AIO_HPP_
+#define AIO_HPP_
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Queue of asynchronous reads and writes at file offsets
+// On Linux it uses io_uring, which keeps many requests in flight and
+// submits a whole batch with one system call. Where io_uring is not
+// available (not built in, old kernel, blocked by a seccomp filter) the
+// same interface runs every request with pread()/pwrite() on submit(), so
+// callers do not need a second code path. Short transfers are continued
+// until the request is complete; a read stops early only at the end of
+// the file.
+class AsyncIo {
+public:
+	enum class Backend {
+		Auto,     // io_uring if the kernel supports it, Portable otherwise
+		IoUring,
+		Portable  // pread()/pwrite()
+	};
+
+	struct Completion {
+		uint64_t tag;   // as given to read() or write()
+		ssize_t result; // bytes transferred, or -errno
+	};
+
+	static constexpr unsigned int DEFAULT_DEPTH = 32;
+
+	// Up to 'depth' requests can be in flight. Throws std::ios_base::failure
+	// if Backend::IoUring is requested but cannot be set up.
+	explicit AsyncIo(unsigned int depth = DEFAULT_DEPTH, Backend backend = Backend::Auto);
+	~AsyncIo();
+
+	AsyncIo(const AsyncIo &) = delete;
+	AsyncIo &operator=(const AsyncIo &) = delete;
+
+	// The backend in use, never Auto
+	Backend backend() const;
+	static const char *backend_name(Backend backend);
+
+	unsigned int depth() const;
+	// Requests queued or submitted whose completion was not returned yet
+	size_t in_flight() const;
+	bool full() const {
+		return in_flight() == depth();
+	}
+
+	// Register buffers that are used for many requests
+	// io_uring pins them once instead of on every request. Requests inside
+	// a registered buffer use it automatically. The buffers must stay valid
+	// while the queue exists. Failing to register (e.g. over the locked
+	// memory limit) is not an error, the requests just take the slower path.
+	void register_buffers(const std::vector<iovec> &buffers);
+	// Register file descriptors that are used for many requests
+	// Saves io_uring looking them up on every request.
+	void register_files(const std::vector<int> &fds);
+
+	// Queue a request, throws std::logic_error if the queue is full()
+	// The buffer must stay valid until its completion was returned.
+	void read(int fd, void *data, size_t length, uint64_t offset, uint64_t tag);
+	void write(int fd, const void *data, size_t length, uint64_t offset, uint64_t tag);
+
+	// Submit all queued requests
+	void submit();
+	// Submit and wait until at least 'min' requests completed
+	// The completions are appended to 'out', returns their number.
+	size_t wait(std::vector<Completion> &out, size_t min = 1);
+
+	struct Impl;
+
+private:
+	std::unique_ptr<Impl> impl;
+};
+
+// Read whole files with up to 'depth' reads in flight
+// 'handler' is called on the calling thread for every file as soon as it
+// was read, so in completion order, with the index of its name and the
+// contents, or the error if it could not be read. The handler may move
+// the contents away to keep them.
+void read_files(const std::vector<std::string> &filenames,
+                const std::function<void(size_t index, std::vector<char> &data, std::exception_ptr error)> &handler,
+                unsigned int depth = AsyncIo::DEFAULT_DEPTH, AsyncIo::Backend backend = AsyncIo::Backend::Auto);
+
+#endif /* AIO_HPP_ */
@@ -0,0 +1,32 @@
+#include "cpu.hpp"
+
+#if defined(__arm__) && defined(SREC_HAVE_NEON)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+namespace {
+
+CpuFeatures detect() {
+	CpuFeatures features;
+#if defined(SREC_HAVE_X86_SIMD)
+	__builtin_cpu_init();
+	features.sse2 = __builtin_cpu_supports("sse2");
+	features.avx2 = __builtin_cpu_supports("avx2");
+	features.pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#elif defined(__aarch64__)
+	features.neon = true;
+#elif defined(SREC_HAVE_NEON)
+	features.neon = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+	return features;
+}
+
+} // namespace
+
+const CpuFeatures &cpu_features() {
+	static const CpuFeatures features = detect();
+	return features;
+}
@@ -0,0 +1,32 @@
+#ifndef CPU_HPP_
+#define CPU_HPP_
+
+// SIMD support compiled into the library
+// x86 kernels are built with function target attributes and selected at
+// runtime, so the library itself can be compiled for a baseline CPU.
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SREC_HAVE_X86_SIMD 1
+#define SREC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// 32-bit ARM hard-float toolchains may default to a VFP-only FPU, enable
+// NEON per function and check HWCAP at runtime. AArch64 always has NEON.
+#if defined(__aarch64__)
+#define SREC_HAVE_NEON 1
+#define SREC_TARGET_NEON
+#elif defined(__arm__) && defined(__ARM_FP)
+#define SREC_HAVE_NEON 1
+#define SREC_TARGET_NEON __attribute__((target("fpu=neon")))
+#endif
+
+// CPU features detected at runtime
+struct CpuFeatures {
+	bool sse2{false};
+	bool avx2{false};
+	bool pclmul{false}; // PCLMULQDQ together with SSSE3
+	bool neon{false};
+};
+
+const CpuFeatures &cpu_features();
+
+#endif /* CPU_HPP_ */
@@ -0,0 +1,247 @@
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "cpu.hpp"
+#include "crc32.hpp"
+
+#if defined(SREC_HAVE_X86_SIMD)
+#include <immintrin.h>
+#define SREC_HAVE_CLMUL 1
+#define SREC_TARGET_CLMUL __attribute__((target("pclmul,ssse3")))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define SREC_HAVE_PMULL 1
+#endif
+
+/* Folding works on the message as a polynomial M in 128-bit blocks. With
+   the init value xored into the first 32 bits, the CRC is (M * x^32) mod P.
+   A block A followed by a block B folds into A * x^128 + B, where A * x^128
+   is congruent to A_hi * (x^192 mod P) + A_lo * (x^128 mod P) for the 64-bit
+   halves of A. Each product has at most 95 bits, so the folded value stays
+   a 128-bit block and the final reduction is the table CRC of its 16 bytes.
+*/
+
+namespace {
+
+// CRC polynomial without the x^32 term
+constexpr uint32_t CRC32_POLY = 0x04C11DB7;
+
+// x^n mod P
+constexpr uint64_t xpow_mod(unsigned int n) {
+	uint32_t r = 1;
+	for (unsigned int i = 0; i < n; ++i) {
+		r = (r << 1) ^ ((r & 0x80000000) ? CRC32_POLY : 0);
+	}
+	return r;
+}
+
+// Fold constants for distances of 4 blocks and 1 block
+constexpr uint64_t K_512_HI = xpow_mod(512 + 64);
+constexpr uint64_t K_512_LO = xpow_mod(512);
+constexpr uint64_t K_128_HI = xpow_mod(128 + 64);
+constexpr uint64_t K_128_LO = xpow_mod(128);
+
+// Multiply two polynomials mod P
+uint32_t gf2_multiply(uint32_t a, uint32_t b) {
+	uint32_t product = 0;
+	for (int i = 31; i >= 0; --i) {
+		product = (product << 1) ^ ((product & 0x80000000) ? CRC32_POLY : 0);
+		if (b & (1u << i)) {
+			product ^= a;
+		}
+	}
+	return product;
+}
+
+// Smallest block handed to a thread by xcrc32_parallel()
+constexpr unsigned long PARALLEL_MIN_BLOCK = 1024 * 1024;
+
+// Smallest buffer worth the setup of the folding loop
+constexpr unsigned long CLMUL_MIN_LENGTH = 64;
+
+#if defined(SREC_HAVE_CLMUL)
+
+// Load 16 bytes as a big endian 128-bit polynomial
+SREC_TARGET_CLMUL inline __m128i load_block(const unsigned char *buf) {
+	const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf)), reverse);
+}
+
+SREC_TARGET_CLMUL inline __m128i fold(__m128i x, __m128i k) {
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+SREC_TARGET_CLMUL unsigned int crc32_pclmul(const unsigned char *buf, unsigned long len, unsigned int init) {
+	const __m128i k512 = _mm_set_epi64x(K_512_HI, K_512_LO);
+	const __m128i k128 = _mm_set_epi64x(K_128_HI, K_128_LO);
+
+	__m128i x0 = _mm_xor_si128(load_block(buf), _mm_set_epi32(static_cast<int>(init), 0, 0, 0));
+	__m128i x1 = load_block(buf + 16);
+	__m128i x2 = load_block(buf + 32);
+	__m128i x3 = load_block(buf + 48);
+	buf += 64;
+	len -= 64;
+
+	// four independent accumulators hide the multiply latency
+	while (len >= 64) {
+		x0 = _mm_xor_si128(fold(x0, k512), load_block(buf));
+		x1 = _mm_xor_si128(fold(x1, k512), load_block(buf + 16));
+		x2 = _mm_xor_si128(fold(x2, k512), load_block(buf + 32));
+		x3 = _mm_xor_si128(fold(x3, k512), load_block(buf + 48));
+		buf += 64;
+		len -= 64;
+	}
+
+	__m128i x = _mm_xor_si128(fold(x0, k128), x1);
+	x = _mm_xor_si128(fold(x, k128), x2);
+	x = _mm_xor_si128(fold(x, k128), x3);
+	while (len >= 16) {
+		x = _mm_xor_si128(fold(x, k128), load_block(buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	// reduce the remaining block, then continue with the tail
+	const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	unsigned char block[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(block), _mm_shuffle_epi8(x, reverse));
+	return xcrc32_table(buf, len, xcrc32_table(block, sizeof(block), 0));
+}
+
+#endif // SREC_HAVE_CLMUL
+
+#if defined(SREC_HAVE_PMULL)
+
+inline uint64x2_t load_block(const unsigned char *buf) {
+	const uint8x16_t b = vrev64q_u8(vld1q_u8(buf));
+	return vreinterpretq_u64_u8(vextq_u8(b, b, 8));
+}
+
+inline uint64x2_t fold(uint64x2_t x, uint64_t k_hi, uint64_t k_lo) {
+	const poly128_t hi = vmull_p64(vgetq_lane_u64(x, 1), k_hi);
+	const poly128_t lo = vmull_p64(vgetq_lane_u64(x, 0), k_lo);
+	return veorq_u64(vreinterpretq_u64_p128(hi), vreinterpretq_u64_p128(lo));
+}
+
+unsigned int crc32_pmull(const unsigned char *buf, unsigned long len, unsigned int init) {
+	const uint64x2_t crc_init = vsetq_lane_u64(static_cast<uint64_t>(init) << 32, vdupq_n_u64(0), 1);
+	uint64x2_t x0 = veorq_u64(load_block(buf), crc_init);
+	uint64x2_t x1 = load_block(buf + 16);
+	uint64x2_t x2 = load_block(buf + 32);
+	uint64x2_t x3 = load_block(buf + 48);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = veorq_u64(fold(x0, K_512_HI, K_512_LO), load_block(buf));
+		x1 = veorq_u64(fold(x1, K_512_HI, K_512_LO), load_block(buf + 16));
+		x2 = veorq_u64(fold(x2, K_512_HI, K_512_LO), load_block(buf + 32));
+		x3 = veorq_u64(fold(x3, K_512_HI, K_512_LO), load_block(buf + 48));
+		buf += 64;
+		len -= 64;
+	}
+
+	uint64x2_t x = veorq_u64(fold(x0, K_128_HI, K_128_LO), x1);
+	x = veorq_u64(fold(x, K_128_HI, K_128_LO), x2);
+	x = veorq_u64(fold(x, K_128_HI, K_128_LO), x3);
+	while (len >= 16) {
+		x = veorq_u64(fold(x, K_128_HI, K_128_LO), load_block(buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	unsigned char block[16];
+	const uint8x16_t b = vreinterpretq_u8_u64(x);
+	vst1q_u8(block, vrev64q_u8(vextq_u8(b, b, 8)));
+	return xcrc32_table(buf, len, xcrc32_table(block, sizeof(block), 0));
+}
+
+#endif // SREC_HAVE_PMULL
+
+} // namespace
+
+unsigned int xcrc32_clmul(const unsigned char *buf, unsigned long len, unsigned int init) {
+	if (len >= CLMUL_MIN_LENGTH) {
+#if defined(SREC_HAVE_CLMUL)
+		if (cpu_features().pclmul) {
+			return crc32_pclmul(buf, len, init);
+		}
+#elif defined(SREC_HAVE_PMULL)
+		return crc32_pmull(buf, len, init);
+#endif
+	}
+	return xcrc32_table(buf, len, init);
+}
+
+unsigned int xcrc32(const unsigned char *buf, unsigned long len, unsigned int init) {
+	return xcrc32_clmul(buf, len, init);
+}
+
+unsigned int xcrc32_shift(unsigned int crc, unsigned long len) {
+	// x^(8 * len) by square and multiply, starting from x^8
+	uint32_t result = 1;
+	uint32_t power = 1u << 8;
+	for (; len > 0; len >>= 1) {
+		if (len & 1) {
+			result = gf2_multiply(result, power);
+		}
+		power = gf2_multiply(power, power);
+	}
+	return gf2_multiply(crc, result);
+}
+
+unsigned int crc32_combine(unsigned int crc_a, unsigned int crc_b, unsigned long len_b) {
+	return xcrc32_shift(crc_a, len_b) ^ crc_b;
+}
+
+unsigned int xcrc32_update(unsigned int crc, const unsigned char *old_data, const unsigned char *new_data,
+                           unsigned long len, unsigned long trailing) {
+	// The CRC is linear: xor in the CRC of the difference, moved past the trailing bytes
+	unsigned char diff[4096];
+	unsigned int delta = 0;
+	while (len > 0) {
+		const unsigned long n = std::min<unsigned long>(len, sizeof(diff));
+		for (unsigned long i = 0; i < n; ++i) {
+			diff[i] = old_data[i] ^ new_data[i];
+		}
+		delta = xcrc32(diff, n, delta);
+		old_data += n;
+		new_data += n;
+		len -= n;
+	}
+	return crc ^ xcrc32_shift(delta, trailing);
+}
+
+unsigned int xcrc32_parallel(const unsigned char *buf, unsigned long len, unsigned int init, unsigned int threads) {
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	threads = static_cast<unsigned int>(std::min<unsigned long>(threads, len / PARALLEL_MIN_BLOCK));
+	if (threads <= 1) {
+		return xcrc32(buf, len, init);
+	}
+
+	// block i covers [i * block, (i + 1) * block), the last one takes the rest
+	const unsigned long block = len / threads;
+	std::vector<unsigned int> crcs(threads);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; ++i) {
+		const unsigned long size = (i == threads - 1) ? len - i * block : block;
+		workers.emplace_back([&crcs, buf, block, size, i] {
+			crcs[i] = xcrc32(buf + i * block, size, 0);
+		});
+	}
+	crcs[0] = xcrc32(buf, block, init);
+	for (auto &worker : workers) {
+		worker.join();
+	}
+
+	unsigned int crc = crcs[0];
+	for (unsigned int i = 1; i < threads; ++i) {
+		const unsigned long size = (i == threads - 1) ? len - i * block : block;
+		crc = crc32_combine(crc, crcs[i], size);
+	}
+	return crc;
+}
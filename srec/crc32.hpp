@@ -4,7 +4,7 @@
 /* For more information on CRC, see, e.g.,
    http://www.ross.net/crc/download/crc_v3.txt. */
 
-static const unsigned int crc32_table[] =
+static constexpr unsigned int crc32_table[] =
 {
   0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
   0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
@@ -72,17 +72,39 @@ static const unsigned int crc32_table[] =
   0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
-/* Compute the 32-bit CRC of buf which has length len. The
-   starting value is init; this may be used to compute the CRC of
-   data split across multiple buffers by passing the return value of each
-   call as the init parameter of the next.
+/* Tables for slicing-by-N: crc32_slice_table[k][i] is the CRC of byte i
+   followed by k zero bytes, crc32_slice_table[0] is crc32_table. Processing
+   N bytes then takes N independent table lookups instead of N dependent
+   shift/lookup steps. */
 
-   This differs from the "standard" CRC-32 algorithm in that the values
-   are not reflected, and there is no final XOR value.  These differences
-   make it easy to compose the values of multiple blocks.
-*/
+#define CRC32_SLICES 16
+
+struct crc32_slices {
+  unsigned int table[CRC32_SLICES][256];
+};
+
+static constexpr crc32_slices make_crc32_slices()
+{
+  crc32_slices s{};
+  for (int i = 0; i < 256; i++)
+    s.table[0][i] = crc32_table[i];
+  for (int k = 1; k < CRC32_SLICES; k++)
+    for (int i = 0; i < 256; i++)
+      s.table[k][i] = (s.table[k - 1][i] << 8) ^ crc32_table[s.table[k - 1][i] >> 24];
+  return s;
+}
+
+static constexpr crc32_slices crc32_slice_table = make_crc32_slices();
 
-static unsigned int xcrc32(const unsigned char *buf, unsigned long len, unsigned int init)
+static inline unsigned int crc32_load_be(const unsigned char *buf)
+{
+  return ((unsigned int) buf[0] << 24) | ((unsigned int) buf[1] << 16)
+         | ((unsigned int) buf[2] << 8) | (unsigned int) buf[3];
+}
+
+/* Byte at a time, one table lookup per byte. */
+
+static inline unsigned int xcrc32_bytewise(const unsigned char *buf, unsigned long len, unsigned int init)
 {
   unsigned int crc = init;
   while (len--) {
@@ -92,4 +114,98 @@ static unsigned int xcrc32(const unsigned char *buf, unsigned long len, unsigned
   return crc;
 }
 
+/* Slicing-by-8, 8 KiB of tables. */
+
+static inline unsigned int xcrc32_slice8(const unsigned char *buf, unsigned long len, unsigned int init)
+{
+  const auto &t = crc32_slice_table.table;
+  unsigned int crc = init;
+  while (len >= 8) {
+	crc ^= crc32_load_be(buf);
+	crc = t[7][crc >> 24] ^ t[6][(crc >> 16) & 0xff] ^ t[5][(crc >> 8) & 0xff] ^ t[4][crc & 0xff]
+	      ^ t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+	buf += 8;
+	len -= 8;
+  }
+  return xcrc32_bytewise(buf, len, crc);
+}
+
+/* Slicing-by-16, 16 KiB of tables. */
+
+static inline unsigned int xcrc32_slice16(const unsigned char *buf, unsigned long len, unsigned int init)
+{
+  const auto &t = crc32_slice_table.table;
+  unsigned int crc = init;
+  while (len >= 16) {
+	crc ^= crc32_load_be(buf);
+	crc = t[15][crc >> 24] ^ t[14][(crc >> 16) & 0xff] ^ t[13][(crc >> 8) & 0xff] ^ t[12][crc & 0xff]
+	      ^ t[11][buf[4]] ^ t[10][buf[5]] ^ t[9][buf[6]] ^ t[8][buf[7]]
+	      ^ t[7][buf[8]] ^ t[6][buf[9]] ^ t[5][buf[10]] ^ t[4][buf[11]]
+	      ^ t[3][buf[12]] ^ t[2][buf[13]] ^ t[1][buf[14]] ^ t[0][buf[15]];
+	buf += 16;
+	len -= 16;
+  }
+  return xcrc32_slice8(buf, len, crc);
+}
+
+/* Table driven CRC: byte-wise for short buffers, otherwise slicing-by-16,
+   or slicing-by-8 on 32-bit ARM where the smaller tables stay in the L1
+   cache. */
+
+static inline unsigned int xcrc32_table(const unsigned char *buf, unsigned long len, unsigned int init)
+{
+  if (len < 16)
+	return xcrc32_bytewise(buf, len, init);
+#if defined(__arm__)
+  return xcrc32_slice8(buf, len, init);
+#else
+  return xcrc32_slice16(buf, len, init);
+#endif
+}
+
+/* Compute the 32-bit CRC of buf which has length len. The
+   starting value is init; this may be used to compute the CRC of
+   data split across multiple buffers by passing the return value of each
+   call as the init parameter of the next.
+
+   This differs from the "standard" CRC-32 algorithm in that the values
+   are not reflected, and there is no final XOR value.  These differences
+   make it easy to compose the values of multiple blocks.
+
+   Large buffers use xcrc32_clmul() when the CPU supports it, everything
+   else goes through xcrc32_table().
+*/
+
+unsigned int xcrc32(const unsigned char *buf, unsigned long len, unsigned int init);
+
+/* Carry-less multiplication folding: PCLMULQDQ on x86 (selected at run
+   time) or PMULL on AArch64 builds with the crypto extension. Falls back
+   to xcrc32_table() when neither is available. */
+
+unsigned int xcrc32_clmul(const unsigned char *buf, unsigned long len, unsigned int init);
+
+/* Multiply crc by x^(8 * len) mod P, i.e. the effect of feeding len zero
+   bytes through xcrc32(). Takes O(log len) steps. */
+
+unsigned int xcrc32_shift(unsigned int crc, unsigned long len);
+
+/* Combine the CRCs of two adjacent blocks A and B: crc_a is the CRC of A
+   with any init value, crc_b the CRC of B with init 0 and len_b its length.
+   The result is the CRC of A followed by B with the init value of crc_a. */
+
+unsigned int crc32_combine(unsigned int crc_a, unsigned int crc_b, unsigned long len_b);
+
+/* Update crc of a buffer after len bytes at some offset were changed from
+   old_data to new_data and trailing bytes follow the changed range.
+   Only the changed bytes are read. */
+
+unsigned int xcrc32_update(unsigned int crc, const unsigned char *old_data, const unsigned char *new_data,
+                           unsigned long len, unsigned long trailing);
+
+/* Split buf into one block per thread, checksum the blocks concurrently
+   and combine the results. threads == 0 uses all hardware threads; small
+   buffers are checksummed on the calling thread. */
+
+unsigned int xcrc32_parallel(const unsigned char *buf, unsigned long len, unsigned int init, unsigned int threads = 0);
+
 #endif // _CRC32_HPP_
@@ -0,0 +1,369 @@
+#include <array>
+#include <string_view>
+
+#include "cpu.hpp"
+#include "hex.hpp"
+
+#if defined(SREC_HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+#if defined(SREC_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+constexpr size_t npos = std::string_view::npos;
+
+// ASCII character to nibble value, -1 for non-hex characters
+constexpr std::array<int8_t, 256> make_nibble_table() {
+	std::array<int8_t, 256> table{};
+	for (int i = 0; i < 256; ++i) {
+		table[i] = -1;
+	}
+	for (int i = 0; i < 10; ++i) {
+		table['0' + i] = static_cast<int8_t>(i);
+	}
+	for (int i = 0; i < 6; ++i) {
+		table['A' + i] = static_cast<int8_t>(10 + i);
+		table['a' + i] = static_cast<int8_t>(10 + i);
+	}
+	return table;
+}
+
+constexpr std::array<int8_t, 256> nibble_table = make_nibble_table();
+
+// Decode 'pairs' hex pairs, returns the position of the first invalid character
+// The sum of the decoded bytes is added to 'sum'.
+size_t decode_scalar(const char *in, size_t pairs, uint8_t *out, unsigned int &sum) {
+	for (size_t i = 0; i < pairs; ++i) {
+		const int hi = nibble_table[static_cast<unsigned char>(in[2 * i])];
+		const int lo = nibble_table[static_cast<unsigned char>(in[2 * i + 1])];
+		if ((hi | lo) < 0) {
+			return hi < 0 ? 2 * i : 2 * i + 1;
+		}
+		out[i] = static_cast<uint8_t>((hi << 4) | lo);
+		sum += out[i];
+	}
+	return npos;
+}
+
+// Finish a vector loop: decode the tail, or locate the error in the
+// block that failed validation
+size_t decode_rest(const char *in, size_t pairs, uint8_t *out, size_t done, unsigned int &sum) {
+	size_t pos = decode_scalar(in + 2 * done, pairs - done, out + done, sum);
+	return pos == npos ? npos : 2 * done + pos;
+}
+
+// Encode 'length' bytes, returns their sum
+unsigned int encode_scalar(const uint8_t *in, size_t length, char *out) {
+	unsigned int sum = 0;
+	for (size_t i = 0; i < length; ++i) {
+		hex_byte(in[i], out + 2 * i);
+		sum += in[i];
+	}
+	return sum;
+}
+
+#if defined(SREC_HAVE_X86_SIMD)
+
+// Convert 16 characters to nibble values, sets 'valid' to a byte mask
+inline __m128i nibbles_sse2(__m128i c, __m128i &valid) {
+	const __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+	                                       _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	const __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+	                                       _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	valid = _mm_or_si128(is_digit, is_alpha);
+	return _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+	                    _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+// Merge nibble pairs of each 16-bit lane into a byte in the low half
+inline __m128i merge_sse2(__m128i v) {
+	return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00F0)),
+	                    _mm_srli_epi16(v, 8));
+}
+
+size_t decode_sse2(const char *in, size_t pairs, uint8_t *out, unsigned int &sum) {
+	__m128i sums = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= pairs; i += 16) {
+		__m128i valid_a, valid_b;
+		const __m128i a = nibbles_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i)), valid_a);
+		const __m128i b = nibbles_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i + 16)), valid_b);
+		if (_mm_movemask_epi8(_mm_and_si128(valid_a, valid_b)) != 0xFFFF) {
+			break;
+		}
+		const __m128i bytes = _mm_packus_epi16(merge_sse2(a), merge_sse2(b));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), bytes);
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+	}
+	sum += static_cast<unsigned int>(_mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+	return decode_rest(in, pairs, out, i, sum);
+}
+
+SREC_TARGET_AVX2 inline __m256i nibbles_avx2(__m256i c, __m256i &valid) {
+	const __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	const __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+	                                          _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+	const __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+	                                          _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+	valid = _mm256_or_si256(is_digit, is_alpha);
+	return _mm256_or_si256(_mm256_and_si256(is_digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+	                       _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+}
+
+SREC_TARGET_AVX2 inline __m256i merge_avx2(__m256i v) {
+	return _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 4), _mm256_set1_epi16(0x00F0)),
+	                       _mm256_srli_epi16(v, 8));
+}
+
+SREC_TARGET_AVX2 size_t decode_avx2(const char *in, size_t pairs, uint8_t *out, unsigned int &sum) {
+	__m256i sums = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= pairs; i += 32) {
+		__m256i valid_a, valid_b;
+		const __m256i a = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i)), valid_a);
+		const __m256i b = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * i + 32)), valid_b);
+		if (_mm256_movemask_epi8(_mm256_and_si256(valid_a, valid_b)) != -1) {
+			break;
+		}
+		// packus works per 128-bit lane, restore the byte order afterwards
+		const __m256i packed = _mm256_packus_epi16(merge_avx2(a), merge_avx2(b));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(packed, _mm256_setzero_si256()));
+	}
+	const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+	sum += static_cast<unsigned int>(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+	// clear the upper halves so the SSE code does not pay for AVX state transitions
+	_mm256_zeroupper();
+	// finish with 16-byte blocks before going scalar
+	if (i + 16 <= pairs) {
+		size_t pos = decode_sse2(in + 2 * i, pairs - i, out + i, sum);
+		return pos == npos ? npos : 2 * i + pos;
+	}
+	return decode_rest(in, pairs, out, i, sum);
+}
+
+// Convert nibble values 0-15 to upper case ASCII hex digits
+inline __m128i ascii_sse2(__m128i n) {
+	const __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '0' - 10));
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+unsigned int encode_sse2(const uint8_t *in, size_t length, char *out) {
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	__m128i sums = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+		const __m128i hi = ascii_sse2(_mm_and_si128(_mm_srli_epi16(b, 4), mask));
+		const __m128i lo = ascii_sse2(_mm_and_si128(b, mask));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(b, _mm_setzero_si128()));
+	}
+	unsigned int sum = static_cast<unsigned int>(_mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+	return sum + encode_scalar(in + i, length - i, out + 2 * i);
+}
+
+SREC_TARGET_AVX2 inline __m256i ascii_avx2(__m256i n) {
+	const __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8('A' - '0' - 10));
+	return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letter);
+}
+
+SREC_TARGET_AVX2 unsigned int encode_avx2(const uint8_t *in, size_t length, char *out) {
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	__m256i sums = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+		const __m256i hi = ascii_avx2(_mm256_and_si256(_mm256_srli_epi16(b, 4), mask));
+		const __m256i lo = ascii_avx2(_mm256_and_si256(b, mask));
+		// unpack works per 128-bit lane, reorder the halves when storing
+		const __m256i first = _mm256_unpacklo_epi8(hi, lo);
+		const __m256i second = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(b, _mm256_setzero_si256()));
+	}
+	const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+	unsigned int sum = static_cast<unsigned int>(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+	_mm256_zeroupper();
+	return sum + encode_sse2(in + i, length - i, out + 2 * i);
+}
+
+#endif // SREC_HAVE_X86_SIMD
+
+#if defined(SREC_HAVE_NEON)
+
+SREC_TARGET_NEON inline uint8x16_t nibbles_neon(uint8x16_t c, uint8x16_t &valid) {
+	const uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+	const uint8x16_t alpha = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	const uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+	const uint8x16_t is_alpha = vcltq_u8(alpha, vdupq_n_u8(6));
+	valid = vorrq_u8(is_digit, is_alpha);
+	return vbslq_u8(is_digit, digit, vaddq_u8(alpha, vdupq_n_u8(10)));
+}
+
+SREC_TARGET_NEON size_t decode_neon(const char *in, size_t pairs, uint8_t *out, unsigned int &sum) {
+	uint32x4_t sums = vdupq_n_u32(0);
+	size_t i = 0;
+	for (; i + 16 <= pairs; i += 16) {
+		// de-interleave into high and low nibble characters
+		const uint8x16x2_t c = vld2q_u8(reinterpret_cast<const uint8_t *>(in + 2 * i));
+		uint8x16_t valid_hi, valid_lo;
+		const uint8x16_t hi = nibbles_neon(c.val[0], valid_hi);
+		const uint8x16_t lo = nibbles_neon(c.val[1], valid_lo);
+		const uint64x2_t invalid = vreinterpretq_u64_u8(vmvnq_u8(vandq_u8(valid_hi, valid_lo)));
+		if ((vgetq_lane_u64(invalid, 0) | vgetq_lane_u64(invalid, 1)) != 0) {
+			break;
+		}
+		const uint8x16_t bytes = vorrq_u8(vshlq_n_u8(hi, 4), lo);
+		vst1q_u8(out + i, bytes);
+		sums = vaddq_u32(sums, vpaddlq_u16(vpaddlq_u8(bytes)));
+	}
+	sum += vgetq_lane_u32(sums, 0) + vgetq_lane_u32(sums, 1) + vgetq_lane_u32(sums, 2) + vgetq_lane_u32(sums, 3);
+	return decode_rest(in, pairs, out, i, sum);
+}
+
+SREC_TARGET_NEON inline uint8x16_t ascii_neon(uint8x16_t n) {
+	const uint8x16_t letter = vandq_u8(vcgtq_u8(n, vdupq_n_u8(9)), vdupq_n_u8('A' - '0' - 10));
+	return vaddq_u8(vaddq_u8(n, vdupq_n_u8('0')), letter);
+}
+
+SREC_TARGET_NEON unsigned int encode_neon(const uint8_t *in, size_t length, char *out) {
+	uint32x4_t sums = vdupq_n_u32(0);
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		const uint8x16_t b = vld1q_u8(in + i);
+		uint8x16x2_t chars;
+		chars.val[0] = ascii_neon(vshrq_n_u8(b, 4));
+		chars.val[1] = ascii_neon(vandq_u8(b, vdupq_n_u8(0x0F)));
+		// interleave high and low digits while storing
+		vst2q_u8(reinterpret_cast<uint8_t *>(out + 2 * i), chars);
+		sums = vaddq_u32(sums, vpaddlq_u16(vpaddlq_u8(b)));
+	}
+	unsigned int sum = vgetq_lane_u32(sums, 0) + vgetq_lane_u32(sums, 1) + vgetq_lane_u32(sums, 2) + vgetq_lane_u32(sums, 3);
+	return sum + encode_scalar(in + i, length - i, out + 2 * i);
+}
+
+#endif // SREC_HAVE_NEON
+
+bool supported(HexKernel kernel) {
+	const CpuFeatures &cpu = cpu_features();
+	switch (kernel) {
+		case HexKernel::Scalar:
+			return true;
+		case HexKernel::SSE2:
+			return cpu.sse2;
+		case HexKernel::AVX2:
+			return cpu.avx2;
+		case HexKernel::NEON:
+			return cpu.neon;
+	}
+	return false;
+}
+
+} // namespace
+
+HexKernel hex_kernel() {
+	static const HexKernel best = [] {
+		if (supported(HexKernel::AVX2)) {
+			return HexKernel::AVX2;
+		}
+		if (supported(HexKernel::SSE2)) {
+			return HexKernel::SSE2;
+		}
+		if (supported(HexKernel::NEON)) {
+			return HexKernel::NEON;
+		}
+		return HexKernel::Scalar;
+	}();
+	return best;
+}
+
+const char *hex_kernel_name(HexKernel kernel) {
+	switch (kernel) {
+		case HexKernel::Scalar:
+			return "scalar";
+		case HexKernel::SSE2:
+			return "sse2";
+		case HexKernel::AVX2:
+			return "avx2";
+		case HexKernel::NEON:
+			return "neon";
+	}
+	return "unknown";
+}
+
+unsigned int hex_encode(const uint8_t *in, size_t length, char *out) {
+	return hex_encode(in, length, out, hex_kernel());
+}
+
+unsigned int hex_encode(const uint8_t *in, size_t length, char *out, HexKernel kernel) {
+	if (!supported(kernel)) {
+		kernel = HexKernel::Scalar;
+	}
+	switch (kernel) {
+#if defined(SREC_HAVE_X86_SIMD)
+		case HexKernel::SSE2:
+			return encode_sse2(in, length, out);
+		case HexKernel::AVX2:
+			return encode_avx2(in, length, out);
+#endif
+#if defined(SREC_HAVE_NEON)
+		case HexKernel::NEON:
+			return encode_neon(in, length, out);
+#endif
+		default:
+			return encode_scalar(in, length, out);
+	}
+}
+
+size_t hex_decode(std::string_view hex, uint8_t *out) {
+	unsigned int sum = 0;
+	return hex_decode(hex, out, sum, hex_kernel());
+}
+
+size_t hex_decode(std::string_view hex, uint8_t *out, HexKernel kernel) {
+	unsigned int sum = 0;
+	return hex_decode(hex, out, sum, kernel);
+}
+
+size_t hex_decode(std::string_view hex, uint8_t *out, unsigned int &sum) {
+	return hex_decode(hex, out, sum, hex_kernel());
+}
+
+size_t hex_decode(std::string_view hex, uint8_t *out, unsigned int &sum, HexKernel kernel) {
+	const size_t pairs = hex.size() / 2;
+	size_t pos = npos;
+
+	if (!supported(kernel)) {
+		kernel = HexKernel::Scalar;
+	}
+	switch (kernel) {
+#if defined(SREC_HAVE_X86_SIMD)
+		case HexKernel::SSE2:
+			pos = decode_sse2(hex.data(), pairs, out, sum);
+			break;
+		case HexKernel::AVX2:
+			pos = decode_avx2(hex.data(), pairs, out, sum);
+			break;
+#endif
+#if defined(SREC_HAVE_NEON)
+		case HexKernel::NEON:
+			pos = decode_neon(hex.data(), pairs, out, sum);
+			break;
+#endif
+		default:
+			pos = decode_scalar(hex.data(), pairs, out, sum);
+			break;
+	}
+
+	if (pos == npos && hex.size() % 2 != 0) {
+		return hex.size() - 1;
+	}
+	return pos;
+}
@@ -0,0 +1,61 @@
+#ifndef HEX_HPP_
+#define HEX_HPP_
+
+#include <array>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+// Implementations of the hex kernels
+enum class HexKernel {
+	Scalar, SSE2, AVX2, NEON
+};
+
+// Best kernel supported by the running CPU
+HexKernel hex_kernel();
+const char *hex_kernel_name(HexKernel kernel);
+
+// Upper case hex digits of every byte value, two characters per byte
+constexpr std::array<char, 512> make_hex_table() {
+	std::array<char, 512> table{};
+	constexpr char digits[] = "0123456789ABCDEF";
+	for (int i = 0; i < 256; ++i) {
+		table[2 * i] = digits[i >> 4];
+		table[2 * i + 1] = digits[i & 0xF];
+	}
+	return table;
+}
+
+inline constexpr std::array<char, 512> hex_table = make_hex_table();
+
+// Write the two hex digits of a byte
+inline void hex_byte(uint8_t byte, char *out) {
+	out[0] = hex_table[2 * byte];
+	out[1] = hex_table[2 * byte + 1];
+}
+
+// Encode bytes as upper case hex
+// 'out' must have room for 2 * length characters, no terminator is written.
+// Returns the sum of the encoded bytes, so callers can build a record
+// checksum in the same pass.
+unsigned int hex_encode(const uint8_t *in, size_t length, char *out);
+unsigned int hex_encode(const uint8_t *in, size_t length, char *out, HexKernel kernel);
+
+// Decode a string of ASCII hex pairs into bytes
+// 'out' must have room for hex.size() / 2 bytes. Upper and lower case
+// digits are accepted. Returns the position of the first invalid
+// character, or std::string_view::npos if the whole string was decoded.
+// An odd length reports the last character as invalid.
+size_t hex_decode(std::string_view hex, uint8_t *out);
+
+// Same as above, using the given kernel
+// Falls back to the scalar kernel if the CPU does not support it.
+size_t hex_decode(std::string_view hex, uint8_t *out, HexKernel kernel);
+
+// Decode and add the sum of the decoded bytes to 'sum'
+// Lets callers verify a record checksum in the same pass. 'sum' is
+// only meaningful if the whole string was decoded.
+size_t hex_decode(std::string_view hex, uint8_t *out, unsigned int &sum);
+size_t hex_decode(std::string_view hex, uint8_t *out, unsigned int &sum, HexKernel kernel);
+
+#endif /* HEX_HPP_ */
@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.hpp"
+#include "stats.hpp"
+
+namespace {
+
+std::string hex_address(uint64_t address) {
+	std::stringstream ss;
+	ss << "0x" << std::uppercase << std::hex << address;
+	return ss.str();
+}
+
+// Write all of 'data' at the current position, or at 'offset' if it is not negative
+void write_all(int fd, const uint8_t *data, size_t length, off_t offset, const std::string &filename) {
+	SREC_STATS_TIME_BYTES(Write, length);
+	SREC_STATS_ADD(BytesOut, length);
+	while (length > 0) {
+		ssize_t n = offset >= 0 ? ::pwrite(fd, data, length, offset) : ::write(fd, data, length);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::ios_base::failure("Failed to write file: " + filename);
+		}
+		data += n;
+		length -= n;
+		if (offset >= 0) {
+			offset += n;
+		}
+	}
+}
+
+// Write 'length' bytes of 'value'
+void write_fill(int fd, uint8_t value, uint64_t length, off_t offset, const std::string &filename) {
+	// memset on a block is vectorized by the C library; the block is
+	// reused for every gap so long gaps cost one write per MiB
+	static constexpr size_t FILL_BLOCK = 1024 * 1024;
+	std::vector<uint8_t> block(static_cast<size_t>(std::min<uint64_t>(length, FILL_BLOCK)));
+	std::memset(block.data(), value, block.size());
+	while (length > 0) {
+		const size_t n = static_cast<size_t>(std::min<uint64_t>(length, block.size()));
+		write_all(fd, block.data(), n, offset, filename);
+		length -= n;
+		if (offset >= 0) {
+			offset += n;
+		}
+	}
+}
+
+// Open an output file, "-" is stdout
+int open_output(const std::string &filename) {
+	if (filename == "-") {
+		return STDOUT_FILENO;
+	}
+	int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		throw std::ios_base::failure("Failed to open output file: " + filename);
+	}
+	return fd;
+}
+
+void close_output(int fd, const std::string &filename) {
+	if (fd != STDOUT_FILENO && ::close(fd) != 0) {
+		throw std::ios_base::failure("Failed to close file: " + filename);
+	}
+}
+
+// True if gaps can be skipped by seeking
+// Seeking in a file opened with O_APPEND, like stdout of '>> file', does not
+// move where the next write lands, so the holes would vanish.
+bool is_seekable(int fd) {
+	struct stat st{};
+	if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	const int flags = ::fcntl(fd, F_GETFL);
+	return flags >= 0 && (flags & O_APPEND) == 0;
+}
+
+// Buffered sequential output of stream_binary()
+class BlockWriter {
+	static constexpr size_t BLOCK_SIZE = 1024 * 1024;
+
+	int fd;
+	const std::string &filename;
+	std::vector<uint8_t> block;
+	size_t used{0};
+
+public:
+	BlockWriter(int fd, const std::string &filename) : fd(fd), filename(filename), block(BLOCK_SIZE) {}
+
+	void flush() {
+		write_all(fd, block.data(), used, -1, filename);
+		used = 0;
+	}
+
+	void write(const uint8_t *data, size_t length) {
+		if (block.size() - used < length) {
+			flush();
+		}
+		std::copy(data, data + length, block.begin() + used);
+		used += length;
+	}
+
+	void fill(uint8_t value, uint64_t length) {
+		while (length > 0) {
+			if (used == block.size()) {
+				flush();
+			}
+			const size_t n = static_cast<size_t>(std::min<uint64_t>(length, block.size() - used));
+			std::memset(block.data() + used, value, n);
+			used += n;
+			length -= n;
+		}
+	}
+
+	// Leave a hole, the output must be seekable
+	void skip(uint64_t length) {
+		flush();
+		if (::lseek(fd, static_cast<off_t>(length), SEEK_CUR) < 0) {
+			throw std::ios_base::failure("Failed to seek in file: " + filename);
+		}
+	}
+};
+
+// Add [start, end) to a set of coalesced ranges
+void add_range(std::map<uint64_t, uint64_t> &ranges, uint64_t start, uint64_t end) {
+	auto it = ranges.upper_bound(start);
+	if (it != ranges.begin() && std::prev(it)->second >= start) {
+		--it;
+		start = it->first;
+	}
+	// Ranges touching the new one are joined with it
+	while (it != ranges.end() && it->first <= end) {
+		end = std::max(end, it->second);
+		it = ranges.erase(it);
+	}
+	ranges.emplace_hint(it, start, end);
+}
+
+// First address of [start, end) in one of the ranges
+std::optional<uint64_t> range_overlap(const std::map<uint64_t, uint64_t> &ranges, uint64_t start, uint64_t end) {
+	auto it = ranges.upper_bound(start);
+	if (it != ranges.begin() && std::prev(it)->second > start) {
+		return start;
+	}
+	if (it != ranges.end() && it->first < end) {
+		return it->first;
+	}
+	return std::nullopt;
+}
+
+} // namespace
+
+void SrecImage::insert(unsigned int address, const uint8_t *data, size_t length, Overlap overlap) {
+	if (length == 0) {
+		return;
+	}
+
+	const uint64_t start = address;
+	const uint64_t end = start + length;
+	if (end > (uint64_t(1) << 32)) {
+		throw std::out_of_range("Data exceeds the 32-bit address space at " + hex_address(start));
+	}
+
+	// First segment that overlaps or touches the new range
+	auto first = std::lower_bound(segments_.begin(), segments_.end(), start,
+		[](const Segment &segment, uint64_t value) { return segment.end() < value; });
+
+	if (overlap == Overlap::Error) {
+		// Segments are sorted, so only the first one ending after 'start' can overlap first
+		auto it = first;
+		if (it != segments_.end() && it->end() == start) {
+			++it;
+		}
+		if (it != segments_.end() && it->address < end) {
+			throw std::invalid_argument("Overlapping data at " + hex_address(std::max<uint64_t>(start, it->address)));
+		}
+		if (auto at = range_overlap(pending_ranges_, start, end)) {
+			throw std::invalid_argument("Overlapping data at " + hex_address(*at));
+		}
+	}
+
+	// Common case: append a segment or extend the one the data starts in,
+	// e.g. records in address order. Once anything is queued, later data
+	// is queued too so it is placed after it.
+	if (pending_.empty()) {
+		if (first == segments_.end()) {
+			segments_.push_back(Segment{address, std::vector<uint8_t>(data, data + length)});
+			return;
+		}
+		auto next = first + 1;
+		if (first->address <= start && (next == segments_.end() || next->address > end)) {
+			if (end > first->end()) {
+				first->data.resize(end - first->address);
+			}
+			std::copy(data, data + length, first->data.begin() + (start - first->address));
+			return;
+		}
+	}
+
+	pending_.push_back(Pending{address, pending_data_.size(), length});
+	pending_data_.insert(pending_data_.end(), data, data + length);
+	add_range(pending_ranges_, start, end);
+}
+
+void SrecImage::flush() const {
+	if (pending_.empty()) {
+		return;
+	}
+
+	// Union of the segments and the queued ranges, both sorted
+	std::vector<std::pair<uint64_t, uint64_t>> ranges;
+	ranges.reserve(segments_.size() + pending_ranges_.size());
+	auto segment = segments_.begin();
+	auto range = pending_ranges_.begin();
+	while (segment != segments_.end() || range != pending_ranges_.end()) {
+		std::pair<uint64_t, uint64_t> next;
+		if (range == pending_ranges_.end() || (segment != segments_.end() && segment->address < range->first)) {
+			next = {segment->address, segment->end()};
+			++segment;
+		} else {
+			next = *range;
+			++range;
+		}
+		if (!ranges.empty() && ranges.back().second >= next.first) {
+			ranges.back().second = std::max(ranges.back().second, next.second);
+		} else {
+			ranges.push_back(next);
+		}
+	}
+
+	// Old segments first, each lies in exactly one new one; segments no
+	// queued data touches are moved rather than copied
+	std::vector<Segment> merged;
+	merged.reserve(ranges.size());
+	segment = segments_.begin();
+	for (const auto &[range_start, range_end] : ranges) {
+		if (segment != segments_.end() && segment->address == range_start && segment->end() == range_end) {
+			merged.push_back(std::move(*segment));
+			++segment;
+			continue;
+		}
+		merged.push_back(Segment{static_cast<unsigned int>(range_start),
+		                         std::vector<uint8_t>(range_end - range_start)});
+		auto &out = merged.back().data;
+		for (; segment != segments_.end() && segment->address < range_end; ++segment) {
+			std::copy(segment->data.begin(), segment->data.end(), out.begin() + (segment->address - range_start));
+		}
+	}
+
+	// Then the queued data in insertion order, so later inserts win
+	for (const auto &pending : pending_) {
+		auto it = std::upper_bound(merged.begin(), merged.end(), pending.address,
+			[](unsigned int value, const Segment &segment) { return value < segment.address; }) - 1;
+		const auto begin = pending_data_.begin() + pending.offset;
+		std::copy(begin, begin + pending.length, it->data.begin() + (pending.address - it->address));
+	}
+
+	segments_ = std::move(merged);
+	std::vector<Pending>().swap(pending_);
+	std::vector<uint8_t>().swap(pending_data_);
+	pending_ranges_.clear();
+}
+
+void SrecImage::insert(const SrecChunk &chunk, Overlap overlap) {
+	for (const auto &record : chunk.records) {
+		try {
+			insert(record.address, chunk.data.data() + record.offset, record.size, overlap);
+		} catch (const std::exception &err) {
+			throw SrecError(err.what(), record.line_number);
+		}
+	}
+}
+
+void SrecImage::merge(const SrecImage &other, Overlap overlap) {
+	for (const auto &segment : other.segments()) {
+		insert(segment.address, segment.data, overlap);
+	}
+}
+
+void SrecImage::load(SrecReader &reader, Overlap overlap, unsigned int threads) {
+	reader.parse_parallel([this, overlap](const SrecChunk &chunk) {
+		insert(chunk, overlap);
+	}, threads);
+}
+
+const SrecImage::Segment *SrecImage::find(unsigned int address) const {
+	flush();
+	// Last segment starting at or before 'address'
+	auto it = std::upper_bound(segments_.begin(), segments_.end(), address,
+		[](unsigned int value, const Segment &segment) { return value < segment.address; });
+	if (it == segments_.begin()) {
+		return nullptr;
+	}
+	--it;
+	return address < it->end() ? &*it : nullptr;
+}
+
+bool SrecImage::overlaps(unsigned int address, size_t length) const {
+	flush();
+	if (length == 0) {
+		return false;
+	}
+	const uint64_t end = static_cast<uint64_t>(address) + length;
+	auto it = std::lower_bound(segments_.begin(), segments_.end(), static_cast<uint64_t>(address),
+		[](const Segment &segment, uint64_t value) { return segment.end() <= value; });
+	return it != segments_.end() && it->address < end;
+}
+
+bool SrecImage::read(unsigned int address, uint8_t *out, size_t length) const {
+	if (length == 0) {
+		return true;
+	}
+	// Segments are coalesced, so a populated range lies in a single one
+	const Segment *segment = find(address);
+	if (segment == nullptr || static_cast<uint64_t>(address) + length > segment->end()) {
+		return false;
+	}
+	const auto begin = segment->data.begin() + (address - segment->address);
+	std::copy(begin, begin + length, out);
+	return true;
+}
+
+uint64_t SrecImage::size() const {
+	flush();
+	uint64_t total = 0;
+	for (const auto &segment : segments_) {
+		total += segment.data.size();
+	}
+	return total;
+}
+
+unsigned int SrecImage::min_address() const {
+	flush();
+	return segments_.empty() ? 0 : segments_.front().address;
+}
+
+uint64_t SrecImage::max_address() const {
+	flush();
+	return segments_.empty() ? 0 : segments_.back().end();
+}
+
+void SrecImage::write_binary(const std::string &filename, unsigned int base, int fill) const {
+	flush();
+	if (!segments_.empty() && segments_.front().address < base) {
+		throw std::invalid_argument("Data below the base address at " + hex_address(segments_.front().address));
+	}
+
+	int fd = open_output(filename);
+	try {
+		// Regular files are written at each segment's offset, anything else
+		// sequentially. Stdout is always written sequentially, it may already
+		// hold output before ours.
+		const bool seekable = is_seekable(fd) && fd != STDOUT_FILENO;
+		uint64_t pos = 0;
+		for (const auto &segment : segments_) {
+			const uint64_t offset = segment.address - base;
+			if (offset > pos && (fill >= 0 || !seekable)) {
+				write_fill(fd, static_cast<uint8_t>(fill >= 0 ? fill : 0), offset - pos,
+				           seekable ? static_cast<off_t>(pos) : -1, filename);
+			}
+			write_all(fd, segment.data.data(), segment.data.size(), seekable ? static_cast<off_t>(offset) : -1, filename);
+			pos = offset + segment.data.size();
+		}
+		// pwrite() past the end leaves holes, no need to punch them
+		if (seekable && ::ftruncate(fd, static_cast<off_t>(pos)) != 0) {
+			throw std::ios_base::failure("Failed to set size of file: " + filename);
+		}
+	} catch (...) {
+		if (fd != STDOUT_FILENO) {
+			::close(fd);
+		}
+		throw;
+	}
+	close_output(fd, filename);
+}
+
+void stream_binary(SrecStream &stream, const std::string &filename, std::optional<unsigned int> base, int fill,
+                   unsigned int threads) {
+	int fd = open_output(filename);
+	try {
+		// Gaps are skipped relative to the current position, so stdout can seek too
+		const bool seekable = is_seekable(fd);
+		BlockWriter out(fd, filename);
+		bool started = false;
+		uint64_t pos = 0; // next address of the output
+		stream.parse_parallel([&](const SrecChunk &chunk) {
+			for (const auto &record : chunk.records) {
+				if (record.size == 0) {
+					continue;
+				}
+
+				if (!started) {
+					pos = base.value_or(record.address);
+					started = true;
+				}
+				if (record.address < pos) {
+					throw SrecError(record.address < base.value_or(0)
+					                ? "Data below the base address at " + hex_address(record.address)
+					                : "Records out of address order at " + hex_address(record.address), record.line_number);
+				}
+				if (record.address > pos) {
+					if (fill >= 0 || !seekable) {
+						out.fill(static_cast<uint8_t>(fill >= 0 ? fill : 0), record.address - pos);
+					} else {
+						out.skip(record.address - pos);
+					}
+				}
+				out.write(chunk.data.data() + record.offset, record.size);
+				pos = static_cast<uint64_t>(record.address) + record.size;
+			}
+		}, threads);
+		out.flush();
+	} catch (...) {
+		if (fd != STDOUT_FILENO) {
+			::close(fd);
+		}
+		throw;
+	}
+	close_output(fd, filename);
+}
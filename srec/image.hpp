@@ -0,0 +1,122 @@
+#ifndef IMAGE_HPP_
+#define IMAGE_HPP_
+
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "reader.hpp"
+
+// Sparse memory image built from data records
+// Data is kept as a sorted vector of non-overlapping segments; adjacent
+// records are coalesced so each contiguous address range is one segment.
+// Only populated ranges use memory, so a few regions spread over the whole
+// 32-bit address space are cheap.
+// Records out of address order are queued and placed in one pass on the
+// next lookup, so even a shuffled file loads in O(n log n). Lookups may
+// do that pass, so const methods must not be called concurrently.
+class SrecImage {
+public:
+	struct Segment {
+		unsigned int address;
+		std::vector<uint8_t> data;
+
+		// One past the last address, may be 2^32
+		uint64_t end() const {
+			return static_cast<uint64_t>(address) + data.size();
+		}
+	};
+
+	// What to do when new data overlaps data already in the image
+	enum class Overlap {
+		Error,   // throw std::invalid_argument
+		Replace  // the new data wins
+	};
+
+private:
+	// Queued data of an out-of-order insert
+	struct Pending {
+		unsigned int address;
+		size_t offset; // into pending_data_
+		size_t length;
+	};
+
+	mutable std::vector<Segment> segments_;
+	// Inserts not yet placed in segments_, in insertion order
+	mutable std::vector<Pending> pending_;
+	mutable std::vector<uint8_t> pending_data_;
+	// Coalesced address ranges of pending_, start to end, for overlap checks
+	mutable std::map<uint64_t, uint64_t> pending_ranges_;
+
+	// Place the queued inserts in segments_
+	void flush() const;
+
+public:
+	// Add data at 'address'
+	// Extending the segment the data starts in, e.g. records in address
+	// order, is amortized constant time. Anything else is queued in
+	// O(log n) and placed by the next lookup.
+	void insert(unsigned int address, const uint8_t *data, size_t length, Overlap overlap = Overlap::Error);
+	void insert(unsigned int address, const std::vector<uint8_t> &data, Overlap overlap = Overlap::Error) {
+		insert(address, data.data(), data.size(), overlap);
+	}
+	// Add all data records of a parsed chunk
+	void insert(const SrecChunk &chunk, Overlap overlap = Overlap::Error);
+	// Add all segments of another image
+	void merge(const SrecImage &other, Overlap overlap = Overlap::Error);
+
+	// Read all data records of a file
+	void load(SrecReader &reader, Overlap overlap = Overlap::Error, unsigned int threads = 0);
+
+	// Segment holding 'address', nullptr if it is not populated
+	const Segment *find(unsigned int address) const;
+	// True if any byte of the range is populated
+	bool overlaps(unsigned int address, size_t length) const;
+	// Copy a fully populated range into 'out', returns false if there are gaps
+	bool read(unsigned int address, uint8_t *out, size_t length) const;
+
+	// Contiguous spans in address order
+	const std::vector<Segment> &segments() const {
+		flush();
+		return segments_;
+	}
+
+	bool empty() const {
+		return segments_.empty() && pending_.empty();
+	}
+
+	// Write the image as a flat binary file starting at 'base'
+	// Gaps between segments are filled with 'fill', or left as holes in the
+	// file when 'fill' is negative so they take no disk space. Outputs that
+	// cannot seek, like pipes, get the gaps written out as zeros or 'fill'.
+	// "-" writes to stdout.
+	void write_binary(const std::string &filename, unsigned int base, int fill = -1) const;
+
+	// Number of populated bytes
+	uint64_t size() const;
+	// Lowest populated address and one past the highest one
+	unsigned int min_address() const;
+	uint64_t max_address() const;
+
+	void clear() {
+		segments_.clear();
+		pending_.clear();
+		pending_data_.clear();
+		pending_ranges_.clear();
+	}
+};
+
+// Write the data records of a stream as a flat binary file
+// The image is never held in memory, so the records must come in ascending
+// address order, as bin2srec and most linkers write them. The output starts
+// at 'base', or at the first record's address if there is none. Gaps are
+// handled like SrecImage::write_binary() does. "-" writes to stdout.
+// Records are decoded on 'threads' threads while the next blocks are read,
+// 0 uses all hardware threads.
+void stream_binary(SrecStream &stream, const std::string &filename, std::optional<unsigned int> base, int fill = -1,
+                   unsigned int threads = 0);
+
+#endif /* IMAGE_HPP_ */
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.hpp"
+#include "reader.hpp"
+#include "stats.hpp"
+
+namespace {
+
+// Sidecar layout: this header followed by 'count' entries, native byte order
+struct SidecarHeader {
+	char magic[4];
+	uint32_t entry_size;
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t count;
+};
+
+constexpr char SIDECAR_MAGIC[4] = {'S', 'I', 'X', '2'};
+
+// Largest span of lines fetched with a single pread()
+constexpr size_t MAX_BATCH = 1024 * 1024;
+
+size_t line_length(const SrecIndex::Entry &entry) {
+	return 4 + 2 * (entry.type + 1 + entry.size + 1); // S#, count, address, data, checksum
+}
+
+} // namespace
+
+SrecIndex::SrecIndex(const std::string &filename, bool use_sidecar) : filename(filename) {
+	fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::ios_base::failure("Failed to open file: " + filename);
+	}
+
+	struct stat st{};
+	if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		::close(fd);
+		throw std::ios_base::failure("Not a regular file: " + filename);
+	}
+	file_size = st.st_size;
+	mtime_sec = st.st_mtim.tv_sec;
+	mtime_nsec = st.st_mtim.tv_nsec;
+
+	if (use_sidecar && load(sidecar_name(filename))) {
+		loaded = true;
+		return;
+	}
+
+	try {
+		build();
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+
+	if (use_sidecar) {
+		try {
+			save(sidecar_name(filename));
+		} catch (const std::exception &) {
+			// the sidecar is only a cache, e.g. the directory may be read-only
+		}
+	}
+}
+
+SrecIndex::~SrecIndex() {
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+// Index all data records with a single scan of the file
+void SrecIndex::build() {
+	SrecReader reader(filename);
+	const char *base = reader.buffer().data();
+
+	SrecRecord record;
+	while (reader.next(record)) {
+		if (record.type != Srec::Type::S1 && record.type != Srec::Type::S2 && record.type != Srec::Type::S3) {
+			continue;
+		}
+		if (record.size() == 0) {
+			continue;
+		}
+		Entry entry{};
+		entry.offset = record.line.data() - base;
+		entry.address = record.address;
+		entry.line = static_cast<uint32_t>(record.line_number);
+		entry.size = static_cast<uint8_t>(record.size());
+		entry.type = static_cast<uint8_t>(SrecReader::address_size(record.type) - 1);
+		entries_.push_back(entry);
+	}
+
+	std::stable_sort(entries_.begin(), entries_.end(),
+		[](const Entry &a, const Entry &b) { return a.address < b.address; });
+	for (size_t i = 1; i < entries_.size(); ++i) {
+		if (static_cast<uint64_t>(entries_[i - 1].address) + entries_[i - 1].size > entries_[i].address) {
+			throw std::invalid_argument("Overlapping data in " + filename);
+		}
+	}
+}
+
+bool SrecIndex::load(const std::string &sidecar) {
+	std::ifstream in(sidecar, std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+
+	SidecarHeader header{};
+	if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+	    || std::memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0
+	    || header.entry_size != sizeof(Entry)
+	    || header.file_size != file_size
+	    || header.mtime_sec != mtime_sec
+	    || header.mtime_nsec != mtime_nsec
+	    || header.count > file_size) {
+		return false;
+	}
+
+	std::vector<Entry> entries(header.count);
+	if (!in.read(reinterpret_cast<char *>(entries.data()), entries.size() * sizeof(Entry))) {
+		return false;
+	}
+	entries_ = std::move(entries);
+	return true;
+}
+
+void SrecIndex::save(const std::string &sidecar) const {
+	SidecarHeader header{};
+	std::memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+	header.entry_size = sizeof(Entry);
+	header.file_size = file_size;
+	header.mtime_sec = mtime_sec;
+	header.mtime_nsec = mtime_nsec;
+	header.count = entries_.size();
+
+	const std::string tempname = sidecar + ".tmp";
+	{
+		std::ofstream out(tempname, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(entries_.data()), entries_.size() * sizeof(Entry));
+		out.close();
+		if (!out) {
+			std::remove(tempname.c_str());
+			throw std::ios_base::failure("Failed to write index: " + tempname);
+		}
+	}
+	if (std::rename(tempname.c_str(), sidecar.c_str()) != 0) {
+		std::remove(tempname.c_str());
+		throw std::ios_base::failure("Failed to write index: " + sidecar);
+	}
+}
+
+bool SrecIndex::read(unsigned int address, uint8_t *out, size_t length) const {
+	if (length == 0) {
+		return true;
+	}
+	const uint64_t start = address;
+	const uint64_t end = start + length;
+
+	// First record ending after 'start'
+	auto it = std::lower_bound(entries_.begin(), entries_.end(), start,
+		[](const Entry &entry, uint64_t value) { return static_cast<uint64_t>(entry.address) + entry.size <= value; });
+
+	std::vector<char> lines;
+	std::array<uint8_t, SrecRecord::MAX_DATA_SIZE> data;
+	uint64_t pos = start;
+	while (pos < end) {
+		if (it == entries_.end() || it->address > pos) {
+			return false; // gap
+		}
+
+		// Fetch a run of records that are contiguous in memory and in file order at once
+		auto run_end = it + 1;
+		while (run_end != entries_.end() && run_end->address < end
+		       && run_end->address == static_cast<uint64_t>((run_end - 1)->address) + (run_end - 1)->size
+		       && run_end->offset > (run_end - 1)->offset
+		       && run_end->offset + line_length(*run_end) - it->offset <= MAX_BATCH) {
+			++run_end;
+		}
+		const uint64_t span_begin = it->offset;
+		const uint64_t span_end = (run_end - 1)->offset + line_length(*(run_end - 1));
+		lines.resize(span_end - span_begin);
+		size_t done = 0;
+		while (done < lines.size()) {
+			ssize_t n = ::pread(fd, lines.data() + done, lines.size() - done, span_begin + done);
+			SREC_STATS_ADD(Syscalls, 1);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				throw std::ios_base::failure("Failed to read file: " + filename);
+			}
+			done += n;
+			SREC_STATS_ADD(BytesIn, n);
+		}
+
+		for (; it != run_end; ++it) {
+			SrecRecord record;
+			SrecReader::parse(std::string_view(lines.data() + (it->offset - span_begin), line_length(*it)), it->line, record);
+			if (record.address != it->address || record.size() != it->size) {
+				throw std::runtime_error("Index does not match file: " + filename);
+			}
+			record.decode(data.data());
+
+			// copy the part of the record inside the requested range
+			const uint64_t from = std::max<uint64_t>(it->address, start);
+			const uint64_t to = std::min<uint64_t>(static_cast<uint64_t>(it->address) + it->size, end);
+			std::copy(data.begin() + (from - it->address), data.begin() + (to - it->address), out + (from - start));
+			pos = to;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef INDEX_HPP_
+#define INDEX_HPP_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Address index of the data records of an S-record file
+// Maps every S1/S2/S3 record to the byte offset of its line, so a range of
+// addresses can be read by fetching only the lines that cover it. The index
+// can be persisted next to the file as "<file>.sidx"; it is only reused while
+// the file's size and modification time are unchanged.
+class SrecIndex {
+public:
+	struct Entry {
+		uint64_t offset;   // byte offset of the line in the file
+		uint32_t address;
+		uint32_t line;     // 1-based line number, for errors
+		uint8_t size;      // data bytes in the record
+		uint8_t type;      // 1, 2 or 3
+		uint16_t reserved;
+	};
+
+private:
+	std::string filename;
+	int fd{-1};
+	uint64_t file_size{0};
+	int64_t mtime_sec{0};
+	int64_t mtime_nsec{0};
+	bool loaded{false};
+
+	std::vector<Entry> entries_; // sorted by address, not overlapping
+
+	void build();
+	bool load(const std::string &sidecar);
+
+public:
+	// Open 'filename' and index it
+	// With 'use_sidecar' a matching sidecar is loaded instead of scanning
+	// the file, and a new one is written after a scan when possible.
+	explicit SrecIndex(const std::string &filename, bool use_sidecar = true);
+	~SrecIndex();
+
+	SrecIndex(const SrecIndex &) = delete;
+	SrecIndex &operator=(const SrecIndex &) = delete;
+
+	// Copy the data of [address, address + length) into 'out'
+	// Returns false if part of the range is not populated.
+	bool read(unsigned int address, uint8_t *out, size_t length) const;
+
+	// Write the index to 'sidecar', replacing it atomically
+	void save(const std::string &sidecar) const;
+
+	const std::vector<Entry> &entries() const {
+		return entries_;
+	}
+
+	// True if the index came from a sidecar file
+	bool from_sidecar() const {
+		return loaded;
+	}
+
+	static std::string sidecar_name(const std::string &filename) {
+		return filename + ".sidx";
+	}
+};
+
+#endif /* INDEX_HPP_ */
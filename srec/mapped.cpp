@@ -0,0 +1,47 @@
+#include <ios>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped.hpp"
+#include "stats.hpp"
+
+MappedFile::MappedFile(const std::string &filename) : filename(filename) {
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::ios_base::failure("Failed to open file: " + filename);
+	}
+
+	struct stat st{};
+	if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		::close(fd);
+		throw std::ios_base::failure("Not a regular file: " + filename);
+	}
+
+	if (st.st_size > 0) {
+		void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (addr == MAP_FAILED) {
+			::close(fd);
+			throw std::ios_base::failure("Failed to map file: " + filename);
+		}
+		data_ = static_cast<const uint8_t *>(addr);
+		size_ = st.st_size;
+		SREC_STATS_ADD(BytesIn, size_);
+	}
+	::close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data_ != nullptr) {
+		::munmap(const_cast<uint8_t *>(data_), size_);
+	}
+}
+
+bool MappedFile::mappable(const std::string &filename) {
+	struct stat st{};
+	return ::stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
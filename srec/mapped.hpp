@@ -0,0 +1,39 @@
+#ifndef MAPPED_HPP_
+#define MAPPED_HPP_
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Read-only memory mapping of a whole regular file
+class MappedFile {
+	std::string filename;
+	const uint8_t *data_{nullptr};
+	size_t size_{0};
+
+public:
+	// Throws std::ios_base::failure if the file cannot be opened or is not a
+	// regular file. An empty file is not mapped, data() is nullptr then.
+	explicit MappedFile(const std::string &filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const uint8_t *data() const {
+		return data_;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	std::string getFilename() const {
+		return filename;
+	}
+
+	// True if 'filename' can be mapped, i.e. it is a regular file
+	static bool mappable(const std::string &filename);
+};
+
+#endif /* MAPPED_HPP_ */
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__NR_perf_event_open)
+#define SREC_HAVE_PERF 1
+#endif
+#endif
+
+#include "perf.hpp"
+
+namespace {
+
+#if defined(SREC_HAVE_PERF)
+int open_event(const PerfCounters::Event &event, bool inherit, int group_fd, bool group_leader) {
+	perf_event_attr attr{};
+	attr.size = sizeof(attr);
+	attr.type = event.type;
+	attr.config = event.config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = inherit ? 1 : 0;
+	// Inherited counters cannot be read as a group
+	attr.read_format = group_leader ? PERF_FORMAT_GROUP : 0;
+	return static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+}
+
+std::string describe(int error) {
+	switch (error) {
+		case ENOENT:
+		case EOPNOTSUPP:
+			return "not supported by this CPU or kernel";
+		case EACCES:
+		case EPERM:
+			return "not permitted, see /proc/sys/kernel/perf_event_paranoid";
+		default:
+			return std::strerror(error);
+	}
+}
+#endif
+
+} // namespace
+
+const std::vector<PerfCounters::Event> &PerfCounters::hardware_events() {
+#if defined(SREC_HAVE_PERF)
+	static const std::vector<Event> events{
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+	};
+#else
+	// Same names, nothing can be opened
+	static const std::vector<Event> events{
+		{0, 0, "cycles"},
+		{0, 1, "instructions"},
+		{0, 3, "cache_misses"},
+		{0, 5, "branch_misses"},
+	};
+#endif
+	return events;
+}
+
+PerfCounters::PerfCounters(const std::vector<Event> &events, Scope scope)
+	: events(events), scope(scope), fds(events.size(), -1) {
+#if defined(SREC_HAVE_PERF)
+	for (size_t i = 0; i < events.size(); ++i) {
+		if (scope == Scope::Process) {
+			fds[i] = open_event(events[i], true, -1, false);
+		} else {
+			// The first counter leads the group, which the kernel schedules as a whole
+			fds[i] = open_event(events[i], false, leader, leader < 0);
+			if (fds[i] >= 0) {
+				if (leader < 0) {
+					leader = fds[i];
+				}
+				group.push_back(i);
+			}
+		}
+		if (fds[i] < 0 && error_.empty()) {
+			error_ = std::string(events[i].name) + ": " + describe(errno);
+		}
+	}
+	group_values.resize(1 + group.size());
+#else
+	if (!events.empty()) {
+		error_ = "perf_event_open is not available on this platform";
+	}
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+	for (int fd : fds) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+}
+
+bool PerfCounters::any_available() const {
+	return std::any_of(fds.begin(), fds.end(), [](int fd) { return fd >= 0; });
+}
+
+void PerfCounters::read(uint64_t *values) const {
+	std::fill(values, values + events.size(), 0);
+	if (scope == Scope::Thread) {
+		if (leader < 0) {
+			return;
+		}
+		// number of members followed by their values, one system call for all
+		std::vector<uint64_t> &data = group_values;
+		const ssize_t n = ::read(leader, data.data(), data.size() * sizeof(uint64_t));
+		if (n < static_cast<ssize_t>(sizeof(uint64_t))) {
+			return;
+		}
+		const size_t received = static_cast<size_t>(n) / sizeof(uint64_t) - 1;
+		const size_t count = std::min({static_cast<size_t>(data[0]), group.size(), received});
+		for (size_t i = 0; i < count; ++i) {
+			values[group[i]] = data[1 + i];
+		}
+		return;
+	}
+	for (size_t i = 0; i < fds.size(); ++i) {
+		uint64_t value = 0;
+		if (fds[i] >= 0 && ::read(fds[i], &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value))) {
+			values[i] = value;
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef PERF_HPP_
+#define PERF_HPP_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Performance counters read through perf_event_open()
+// Counts user space only, so it works with the default
+// perf_event_paranoid setting without privileges. Counters the kernel or
+// the CPU do not offer (no PMU in a VM, an older ARM core, a seccomp
+// filter, not Linux) are unavailable and read as 0; the others still work.
+class PerfCounters {
+public:
+	// perf_event_attr type and config
+	struct Event {
+		uint32_t type;
+		uint64_t config;
+		const char *name;
+	};
+
+	enum class Scope {
+		Thread, // the calling thread
+		Process // the calling thread and the threads it starts later, which count once they exit
+	};
+
+	// Cycles, instructions, cache misses and branch misses
+	static const std::vector<Event> &hardware_events();
+
+	PerfCounters(const std::vector<Event> &events, Scope scope);
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	size_t size() const {
+		return events.size();
+	}
+	const Event &event(size_t i) const {
+		return events[i];
+	}
+	bool available(size_t i) const {
+		return fds[i] >= 0;
+	}
+	bool any_available() const;
+	// Why the first unavailable counter could not be opened
+	const std::string &error() const {
+		return error_;
+	}
+
+	// Current counts, size() values
+	// Counters of Scope::Thread must be read by the thread that opened them.
+	void read(uint64_t *values) const;
+
+private:
+	std::vector<Event> events;
+	Scope scope;
+	std::vector<int> fds;
+	int leader{-1}; // of the group read at once in Thread scope
+	std::vector<size_t> group; // event index of each group member
+	mutable std::vector<uint64_t> group_values;
+	std::string error_;
+};
+
+#endif /* PERF_HPP_ */
@@ -0,0 +1,336 @@
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <unistd.h>
+
+#include "ring.hpp"
+#include "stats.hpp"
+#include "threadpool.hpp"
+
+// Three stage pipeline over the blocks of a file descriptor
+// An I/O thread reads fixed size blocks, 'workers' threads transform them
+// and the calling thread consumes the results in input order, so reading,
+// computing and writing overlap. The stages are connected by SpscRing
+// queues: block i goes to worker i % workers and its result is taken from
+// the same worker's queue, which keeps the order without a reorder buffer.
+// Block buffers are recycled; memory use is DEPTH blocks per worker plus
+// the results in flight, however long the input is. A stage that finds its
+// queue full or empty spins briefly and then sleeps until another stage
+// moves a block, so waiting on slow I/O does not burn a core per thread.
+template <class Result>
+class BlockPipeline {
+public:
+	// How the input is cut into blocks
+	enum class Split {
+		Bytes, // exactly block_size bytes, except for the last block
+		Lines  // up to block_size bytes ending after a newline
+	};
+
+	// Called on a worker thread with the block and its offset in the input
+	using Transform = std::function<Result(const char *data, size_t length, uint64_t offset)>;
+	// Called on the calling thread, in input order
+	using Consume = std::function<void(Result &result)>;
+
+	static constexpr size_t DEPTH = 2; // blocks per worker
+
+private:
+	struct Block {
+		std::vector<char> data;
+		size_t size{0};
+		uint64_t offset{0};
+		bool end{false};
+		std::exception_ptr error;
+	};
+
+	struct Item {
+		Result result{};
+		bool end{false};
+		std::exception_ptr error;
+	};
+
+	// Queues of one worker
+	struct Lane {
+		SpscRing<Block> input{DEPTH};
+		SpscRing<Block> free{DEPTH};
+		SpscRing<Item> output{DEPTH};
+	};
+
+	size_t block_size;
+	Split split;
+	unsigned int workers;
+	std::atomic<bool> cancelled{false};
+
+	// Stages that gave up spinning sleep here until a queue changes
+	std::mutex park_mutex;
+	std::condition_variable parked;
+	unsigned int events{0}; // queue changes seen by sleepers, under park_mutex
+	std::atomic<unsigned int> sleepers{0};
+
+	// Wake the sleeping stages, cheap when there are none
+	void notify() {
+		// Orders the queue update before reading 'sleepers', pairs with the fence in wait()
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) != 0) {
+			std::lock_guard<std::mutex> lock(park_mutex);
+			++events;
+			parked.notify_all();
+		}
+	}
+
+	template <class T>
+	bool push(SpscRing<T> &ring, T &value) {
+		if (!ring.try_push(value)) {
+			return false;
+		}
+		notify();
+		return true;
+	}
+
+	template <class T>
+	bool pop(SpscRing<T> &ring, T &value) {
+		if (!ring.try_pop(value)) {
+			return false;
+		}
+		notify();
+		return true;
+	}
+
+	void cancel() {
+		cancelled = true;
+		notify();
+	}
+
+	// Wait for a queue operation, returns false if the pipeline was cancelled
+	template <class F>
+	bool wait(F &&f) {
+		if (f()) {
+			return true;
+		}
+		SREC_STATS_TIME(Wait);
+		for (unsigned int spins = 0; spins < 128; ++spins) {
+			if (f()) {
+				return true;
+			}
+			if (cancelled.load(std::memory_order_relaxed)) {
+				return false;
+			}
+			if (spins >= 64) {
+				std::this_thread::yield();
+			}
+		}
+
+		// A queue update either is seen by f() or sees 'sleepers' and
+		// counts an event after 'seen' was taken
+		sleepers.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool done;
+		for (;;) {
+			unsigned int seen;
+			{
+				std::lock_guard<std::mutex> lock(park_mutex);
+				seen = events;
+			}
+			if ((done = f()) || cancelled.load(std::memory_order_relaxed)) {
+				break;
+			}
+			std::unique_lock<std::mutex> lock(park_mutex);
+			parked.wait(lock, [&] { return events != seen; });
+		}
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+		return done;
+	}
+
+	// Read until 'length' bytes are in 'out' or the input ends
+	static size_t read_full(int fd, char *out, size_t length) {
+		size_t done = 0;
+		while (done < length) {
+			ssize_t n = ::read(fd, out + done, length - done);
+			SREC_STATS_ADD(Syscalls, 1);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::ios_base::failure("Failed to read input");
+			}
+			if (n == 0) {
+				break;
+			}
+			done += n;
+		}
+		return done;
+	}
+
+	void read_stage(int fd, std::string_view prefix, std::vector<std::unique_ptr<Lane>> &lanes) {
+		SREC_STATS_THREAD("read");
+		size_t w = 0;
+		std::exception_ptr error;
+		try {
+			std::vector<char> carry(prefix.begin(), prefix.end());
+			uint64_t offset = 0;
+			bool eof = fd < 0;
+			for (;;) {
+				Block block;
+				if (!wait([&] { return pop(lanes[w]->free, block); })) {
+					return;
+				}
+
+				// the unfinished line of the previous block comes first
+				std::copy(carry.begin(), carry.end(), block.data.begin());
+				block.size = carry.size();
+				carry.clear();
+				if (!eof) {
+					SREC_STATS_TIME(Read);
+					const size_t n = read_full(fd, block.data.data() + block.size, block.data.size() - block.size);
+					block.size += n;
+					SREC_STATS_ADD(BytesIn, n);
+					eof = block.size < block.data.size();
+				}
+				if (split == Split::Lines && !eof) {
+					const void *nl = ::memrchr(block.data.data(), '\n', block.size);
+					if (nl == nullptr) {
+						throw std::invalid_argument("Line longer than the block size");
+					}
+					const size_t size = static_cast<const char *>(nl) - block.data.data() + 1;
+					carry.assign(block.data.begin() + size, block.data.begin() + block.size);
+					block.size = size;
+				}
+				if (block.size == 0) {
+					break;
+				}
+
+				block.offset = offset;
+				offset += block.size;
+				if (!wait([&] { return push(lanes[w]->input, block); })) {
+					return;
+				}
+				w = (w + 1) % lanes.size();
+				if (eof && carry.empty()) {
+					break;
+				}
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		// End markers in block order, so the consumer sees them where the next block would be
+		for (size_t i = 0; i < lanes.size(); ++i) {
+			Block block;
+			block.end = true;
+			block.error = i == 0 ? error : nullptr;
+			if (!wait([&] { return push(lanes[(w + i) % lanes.size()]->input, block); })) {
+				return;
+			}
+		}
+	}
+
+	void work_stage(Lane &lane, const Transform &transform) {
+		SREC_STATS_THREAD("worker");
+		for (;;) {
+			Block block;
+			if (!wait([&] { return pop(lane.input, block); })) {
+				return;
+			}
+
+			Item item;
+			if (block.end) {
+				item.end = true;
+				item.error = block.error;
+				wait([&] { return push(lane.output, item); });
+				return;
+			}
+			try {
+				item.result = transform(block.data.data(), block.size, block.offset);
+			} catch (...) {
+				item.error = std::current_exception();
+			}
+			if (!wait([&] { return push(lane.free, block); })) {
+				return;
+			}
+			if (!wait([&] { return push(lane.output, item); })) {
+				return;
+			}
+		}
+	}
+
+public:
+	// workers == 0 uses all hardware threads
+	BlockPipeline(size_t block_size, Split split, unsigned int workers = 0)
+		: block_size(block_size), split(split), workers(workers != 0 ? workers : ThreadPool::default_threads()) {
+		if (block_size == 0) {
+			throw std::invalid_argument("Block size must not be zero");
+		}
+	}
+
+	BlockPipeline(const BlockPipeline &) = delete;
+	BlockPipeline &operator=(const BlockPipeline &) = delete;
+
+	// Process 'prefix' followed by the rest of 'fd' until it ends
+	// fd < 0 processes only 'prefix', which must not be longer than a block.
+	// Rethrows the first error of any stage after all threads have stopped.
+	void run(int fd, std::string_view prefix, const Transform &transform, const Consume &consume) {
+		if (prefix.size() > block_size) {
+			throw std::invalid_argument("Prefix longer than the block size");
+		}
+		cancelled = false;
+
+		std::vector<std::unique_ptr<Lane>> lanes;
+		for (unsigned int i = 0; i < workers; ++i) {
+			lanes.push_back(std::make_unique<Lane>());
+			for (size_t j = 0; j < DEPTH; ++j) {
+				Block block;
+				block.data.resize(block_size);
+				lanes.back()->free.try_push(block);
+			}
+		}
+
+		std::vector<std::thread> threads;
+		auto stop = [&] {
+			for (auto &thread : threads) {
+				thread.join();
+			}
+		};
+		threads.emplace_back([&] { read_stage(fd, prefix, lanes); });
+		for (auto &lane : lanes) {
+			Lane *l = lane.get();
+			threads.emplace_back([this, l, &transform] { work_stage(*l, transform); });
+		}
+
+		try {
+			for (size_t w = 0;; w = (w + 1) % lanes.size()) {
+				Item item;
+				wait([&] { return pop(lanes[w]->output, item); });
+				if (item.error) {
+					std::rethrow_exception(item.error);
+				}
+				if (item.end) {
+					break;
+				}
+				consume(item.result);
+			}
+		} catch (...) {
+			cancel();
+			stop();
+			throw;
+		}
+		stop();
+	}
+};
+
+#endif /* PIPELINE_HPP_ */
@@ -0,0 +1,469 @@
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <deque>
+#include <future>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.hpp"
+#include "hex.hpp"
+#include "pipeline.hpp"
+#include "reader.hpp"
+#include "stats.hpp"
+#include "threadpool.hpp"
+
+namespace {
+
+// Convert a single ASCII hex character to its value, -1 if invalid
+int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Parse a string of hex characters into a number
+bool parse_hex(std::string_view str, unsigned int &value) {
+	value = 0;
+	for (const auto c : str) {
+		int v = hex_value(c);
+		if (v < 0) {
+			return false;
+		}
+		value = (value << 4) | static_cast<unsigned int>(v);
+	}
+	return true;
+}
+
+SrecError malformed(const std::string &what, size_t line_number) {
+	return SrecError(what, line_number);
+}
+
+std::string hex_byte_string(uint8_t byte) {
+	char digits[2];
+	hex_byte(byte, digits);
+	return std::string("0x") + digits[0] + digits[1];
+}
+
+} // namespace
+
+SrecChecksumError::SrecChecksumError(size_t line, uint8_t expected, uint8_t actual)
+	: SrecError("Checksum mismatch, record has " + hex_byte_string(expected) + " but data sums to " + hex_byte_string(actual), line),
+	  expected_(expected), actual_(actual) {}
+
+void SrecRecord::decode(uint8_t *out) const {
+	// byte count and address are part of the checksum
+	unsigned int sum = static_cast<unsigned int>(line.size() - 4) / 2;
+	for (unsigned int a = address; a != 0; a >>= 8) {
+		sum += a & 0xFF;
+	}
+
+	size_t bad = hex_decode(payload, out, sum);
+	if (bad != std::string_view::npos) {
+		const size_t column = payload.data() - line.data() + bad + 1;
+		throw malformed("Invalid hex character in column " + std::to_string(column), line_number);
+	}
+
+	unsigned int checksum;
+	if (!parse_hex(line.substr(line.size() - 2), checksum)) {
+		throw malformed("Invalid checksum", line_number);
+	}
+	const uint8_t actual = static_cast<uint8_t>(~sum);
+	if (checksum != actual) {
+		throw SrecChecksumError(line_number, static_cast<uint8_t>(checksum), actual);
+	}
+}
+
+void SrecRecord::verify() const {
+	uint8_t data[MAX_DATA_SIZE];
+	decode(data);
+}
+
+SrecReader::SrecReader(const std::string &filename) : filename(filename) {
+	SREC_STATS_TIME(Read);
+	int fd = filename == "-" ? ::dup(STDIN_FILENO) : ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::ios_base::failure("Failed to open file: " + filename);
+	}
+
+	struct stat st{};
+	if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (addr != MAP_FAILED) {
+			::madvise(addr, st.st_size, MADV_SEQUENTIAL);
+			data = static_cast<const char *>(addr);
+			length = st.st_size;
+			mapped = true;
+		}
+	}
+
+	// Fall back to reading the whole input, e.g. for pipes
+	if (!mapped) {
+		char chunk[64 * 1024];
+		ssize_t n;
+		while ((n = ::read(fd, chunk, sizeof(chunk))) != 0) {
+			SREC_STATS_ADD(Syscalls, 1);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				::close(fd);
+				throw std::ios_base::failure("Failed to read file: " + filename);
+			}
+			storage.insert(storage.end(), chunk, chunk + n);
+		}
+		data = storage.data();
+		length = storage.size();
+	}
+	SREC_STATS_ADD(BytesIn, length);
+	::close(fd);
+}
+
+SrecReader::SrecReader(const std::string &filename, std::vector<char> contents)
+	: filename(filename), storage(std::move(contents)) {
+	data = storage.data();
+	length = storage.size();
+}
+
+SrecReader::~SrecReader() {
+	if (mapped) {
+		::munmap(const_cast<char *>(data), length);
+	}
+}
+
+void SrecReader::rewind() {
+	pos = 0;
+	line_number = 0;
+}
+
+size_t SrecReader::address_size(Srec::Type type) {
+	switch (type) {
+		case Srec::Type::S0:
+		case Srec::Type::S1:
+		case Srec::Type::S5:
+		case Srec::Type::S9:
+			return 2;
+		case Srec::Type::S2:
+		case Srec::Type::S6:
+		case Srec::Type::S8:
+			return 3;
+		case Srec::Type::S3:
+		case Srec::Type::S7:
+			return 4;
+	}
+	return 0;
+}
+
+void SrecReader::parse(std::string_view line, size_t line_number, SrecRecord &record) {
+	if (line.size() < 4 || line[0] != 'S') {
+		throw malformed("Malformed record", line_number);
+	}
+
+	switch (line[1]) {
+		case '0': record.type = Srec::Type::S0; break;
+		case '1': record.type = Srec::Type::S1; break;
+		case '2': record.type = Srec::Type::S2; break;
+		case '3': record.type = Srec::Type::S3; break;
+		case '5': record.type = Srec::Type::S5; break;
+		case '6': record.type = Srec::Type::S6; break;
+		case '7': record.type = Srec::Type::S7; break;
+		case '8': record.type = Srec::Type::S8; break;
+		case '9': record.type = Srec::Type::S9; break;
+		default:
+			throw malformed("Unknown record type", line_number);
+	}
+
+	// byte count covers address, data and checksum
+	unsigned int byte_count;
+	if (!parse_hex(line.substr(2, 2), byte_count)) {
+		throw malformed("Invalid byte count", line_number);
+	}
+	const size_t addr_chars = address_size(record.type) * 2;
+	if (line.size() != 4 + byte_count * 2 || byte_count * 2 < addr_chars + 2) {
+		throw malformed("Byte count does not match record length", line_number);
+	}
+
+	if (!parse_hex(line.substr(4, addr_chars), record.address)) {
+		throw malformed("Invalid address", line_number);
+	}
+
+	record.line = line;
+	record.payload = line.substr(4 + addr_chars, line.size() - 4 - addr_chars - 2);
+	record.line_number = line_number;
+}
+
+bool SrecReader::next_line(const char *data, size_t length, size_t &pos, size_t &line_number, SrecRecord &record) {
+	while (pos < length) {
+		const char *start = data + pos;
+		const void *nl = std::memchr(start, '\n', length - pos);
+		size_t len = nl ? static_cast<const char *>(nl) - start : length - pos;
+		pos += len + (nl ? 1 : 0);
+		line_number++;
+
+		// strip CR of CRLF line endings
+		if (len > 0 && start[len - 1] == '\r') {
+			len--;
+		}
+		if (len == 0 || start[0] != 'S') {
+			continue;
+		}
+
+		parse(std::string_view(start, len), line_number, record);
+		return true;
+	}
+	return false;
+}
+
+bool SrecReader::next(SrecRecord &record) {
+	return next_line(data, length, pos, line_number, record);
+}
+
+// Decode one chunk, line numbers are relative to its start
+SrecChunk SrecReader::parse_chunk(const char *data, size_t length) {
+	SrecChunk chunk;
+	// about half of the characters of a data line are payload
+	chunk.data.reserve(length / 2);
+
+	{
+		SREC_STATS_TIME_BYTES(Decode, length);
+		size_t pos = 0;
+		SrecRecord record;
+		while (next_line(data, length, pos, chunk.lines, record)) {
+			if (record.type != Srec::Type::S1 && record.type != Srec::Type::S2 && record.type != Srec::Type::S3) {
+				record.verify();
+				chunk.others.push_back(record);
+				continue;
+			}
+			const size_t offset = chunk.data.size();
+			chunk.data.resize(offset + record.size());
+			record.decode(chunk.data.data() + offset);
+			chunk.records.push_back({record.type, record.address, offset, record.size(), record.line_number});
+		}
+	}
+	SREC_STATS_ADD(Records, chunk.records.size() + chunk.others.size());
+	SREC_STATS_ADD(Lines, chunk.lines);
+	SREC_STATS_TIME_BYTES(Crc, chunk.data.size());
+	chunk.crc = xcrc32(chunk.data.data(), chunk.data.size(), 0);
+	return chunk;
+}
+
+void SrecReader::parse_parallel(const std::function<void(const SrecChunk &)> &handler,
+                                unsigned int threads, size_t chunk_size) {
+	if (threads == 0) {
+		threads = ThreadPool::default_threads();
+	}
+	if (chunk_size == 0) {
+		chunk_size = DEFAULT_CHUNK_SIZE;
+	}
+
+	// Split the input after the first newline past every chunk_size bytes
+	std::vector<std::pair<size_t, size_t>> ranges;
+	for (size_t begin = 0; begin < length;) {
+		size_t end = length;
+		if (length - begin > chunk_size) {
+			const void *nl = std::memchr(data + begin + chunk_size, '\n', length - begin - chunk_size);
+			end = nl ? static_cast<const char *>(nl) - data + 1 : length;
+		}
+		ranges.emplace_back(begin, end);
+		begin = end;
+	}
+
+	// Renumber the lines of a chunk relative to the whole input
+	size_t base = 0;
+	auto deliver = [&](std::function<SrecChunk()> get) {
+		SrecChunk chunk;
+		try {
+			chunk = get();
+		} catch (const SrecChecksumError &err) {
+			throw SrecChecksumError(base + err.line_number(), err.expected(), err.actual());
+		} catch (const SrecError &err) {
+			throw SrecError(err.reason(), base + err.line_number());
+		}
+		for (auto &record : chunk.records) {
+			record.line_number += base;
+		}
+		for (auto &record : chunk.others) {
+			record.line_number += base;
+		}
+		base += chunk.lines;
+		handler(chunk);
+	};
+
+	if (threads == 1 || ranges.size() <= 1) {
+		for (const auto &range : ranges) {
+			deliver([&] { return parse_chunk(data + range.first, range.second - range.first); });
+		}
+		return;
+	}
+
+	// Keep a bounded number of chunks in flight so memory stays limited
+	ThreadPool pool(threads);
+	std::deque<std::future<SrecChunk>> pending;
+	const size_t window = 2 * static_cast<size_t>(threads);
+	size_t next_range = 0;
+	while (next_range < ranges.size() || !pending.empty()) {
+		while (next_range < ranges.size() && pending.size() < window) {
+			const auto range = ranges[next_range++];
+			const char *start = data + range.first;
+			pending.push_back(pool.submit([start, range] {
+				return parse_chunk(start, range.second - range.first);
+			}));
+		}
+		std::future<SrecChunk> result = std::move(pending.front());
+		pending.pop_front();
+		deliver([&] { return result.get(); });
+	}
+}
+
+SrecStream::SrecStream(const std::string &filename, size_t block_size) : filename(filename), buffer(block_size) {
+	if (block_size < MAX_LINE_LENGTH + 2) {
+		throw std::invalid_argument("Block size must hold at least one record");
+	}
+	if (filename == "-") {
+		fd = STDIN_FILENO;
+		owns_fd = false;
+		return;
+	}
+	fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::ios_base::failure("Failed to open file: " + filename);
+	}
+}
+
+SrecStream::~SrecStream() {
+	if (owns_fd) {
+		::close(fd);
+	}
+}
+
+// Move the unfinished line to the front and read until it is complete
+void SrecStream::refill() {
+	SREC_STATS_TIME(Read);
+	std::memmove(buffer.data(), buffer.data() + pos, end - pos);
+	end -= pos;
+	pos = 0;
+	complete = 0;
+
+	while (complete == 0) {
+		if (end == buffer.size()) {
+			throw malformed("Line too long", line_number + 1);
+		}
+		ssize_t n = ::read(fd, buffer.data() + end, buffer.size() - end);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::ios_base::failure("Failed to read file: " + filename);
+		}
+		SREC_STATS_ADD(BytesIn, n);
+		if (n == 0) {
+			// the last line may have no line ending
+			eof = true;
+			complete = end;
+			return;
+		}
+		const void *nl = ::memrchr(buffer.data() + end, '\n', n);
+		end += n;
+		if (nl != nullptr) {
+			complete = static_cast<const char *>(nl) - buffer.data() + 1;
+		}
+	}
+}
+
+bool SrecStream::next(SrecRecord &record) {
+	for (;;) {
+		if (SrecReader::next_line(buffer.data(), complete, pos, line_number, record)) {
+			return true;
+		}
+		if (eof) {
+			return false;
+		}
+		refill();
+	}
+}
+
+namespace {
+
+// A chunk decoded from a recycled block, with its own copy of the text of
+// the S0 and S5-S9 records
+struct StreamChunk {
+	SrecChunk chunk;
+	std::vector<char> text;
+	std::exception_ptr error;
+};
+
+} // namespace
+
+void SrecStream::parse_parallel(const std::function<void(const SrecChunk &)> &handler, unsigned int threads) {
+	BlockPipeline<StreamChunk> pipeline(buffer.size(), BlockPipeline<StreamChunk>::Split::Lines, threads);
+
+	auto transform = [](const char *data, size_t length, uint64_t) {
+		StreamChunk result;
+		try {
+			result.chunk = SrecReader::parse_chunk(data, length);
+		} catch (...) {
+			// reported in order by the consumer, which knows the line numbers
+			result.error = std::current_exception();
+			return result;
+		}
+		size_t size = 0;
+		for (const auto &record : result.chunk.others) {
+			size += record.line.size();
+		}
+		result.text.resize(size);
+		char *out = result.text.data();
+		for (auto &record : result.chunk.others) {
+			const size_t payload = record.payload.data() - record.line.data();
+			std::copy(record.line.begin(), record.line.end(), out);
+			record.line = std::string_view(out, record.line.size());
+			record.payload = std::string_view(out + payload, record.payload.size());
+			out += record.line.size();
+		}
+		return result;
+	};
+
+	size_t base = line_number;
+	auto consume = [&](StreamChunk &result) {
+		if (result.error) {
+			try {
+				std::rethrow_exception(result.error);
+			} catch (const SrecChecksumError &err) {
+				throw SrecChecksumError(base + err.line_number(), err.expected(), err.actual());
+			} catch (const SrecError &err) {
+				throw SrecError(err.reason(), base + err.line_number());
+			}
+		}
+		SrecChunk &chunk = result.chunk;
+		for (auto &record : chunk.records) {
+			record.line_number += base;
+		}
+		for (auto &record : chunk.others) {
+			record.line_number += base;
+		}
+		base += chunk.lines;
+		handler(chunk);
+	};
+
+	// The buffered rest of the input comes first
+	const std::string_view prefix(buffer.data() + pos, end - pos);
+	pipeline.run(eof ? -1 : fd, prefix, transform, consume);
+
+	pos = complete = end = 0;
+	eof = true;
+	line_number = base;
+}
@@ -0,0 +1,197 @@
+#ifndef READER_HPP_
+#define READER_HPP_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+
+#include "srec.hpp"
+
+// Malformed input, thrown with the line it was found on
+class SrecError : public std::invalid_argument {
+	std::string reason_;
+	size_t line_;
+public:
+	SrecError(const std::string &reason, size_t line)
+		: std::invalid_argument(reason + " at line " + std::to_string(line)), reason_(reason), line_(line) {};
+
+	const std::string &reason() const {
+		return reason_;
+	}
+
+	size_t line_number() const {
+		return line_;
+	}
+};
+
+// A record whose checksum byte does not match its contents
+class SrecChecksumError : public SrecError {
+	uint8_t expected_;
+	uint8_t actual_;
+public:
+	SrecChecksumError(size_t line, uint8_t expected, uint8_t actual);
+
+	// Checksum stored in the record
+	uint8_t expected() const {
+		return expected_;
+	}
+
+	// Checksum computed from the byte count, address and data
+	uint8_t actual() const {
+		return actual_;
+	}
+};
+
+// A single record as seen by SrecReader
+// The views point into the reader's input buffer and stay valid
+// for as long as the reader is alive; no memory is allocated per record.
+struct SrecRecord {
+	static constexpr size_t MAX_DATA_SIZE = 255; // upper bound of size()
+
+	Srec::Type type{Srec::Type::S0};
+	unsigned int address{0};   // address field (or count for S5/S6)
+	std::string_view line;     // whole line without the line ending
+	std::string_view payload;  // hex characters of the data field, checksum excluded
+	size_t line_number{0};     // 1-based line number in the input
+
+	// Number of data bytes in the record
+	size_t size() const {
+		return payload.size() / 2;
+	}
+
+	// Decode the payload into 'out', which must hold size() bytes
+	// The checksum is verified while decoding. Throws SrecError if the
+	// record has non-hex characters and SrecChecksumError if the checksum
+	// does not match.
+	void decode(uint8_t *out) const;
+	// Verify the record without keeping the data
+	void verify() const;
+};
+
+// Records of one part of the input, decoded by SrecReader::parse_parallel()
+struct SrecChunk {
+	// Position of a data record's payload in 'data'
+	struct Record {
+		Srec::Type type;
+		unsigned int address;
+		size_t offset;
+		size_t size;
+		size_t line_number;
+	};
+
+	std::vector<uint8_t> data;      // payloads of all S1/S2/S3 records in file order
+	std::vector<Record> records;    // data records in file order
+	std::vector<SrecRecord> others; // S0 and S5-S9 records
+	unsigned int crc{0};            // xcrc32 of 'data' with init 0
+	size_t lines{0};                // lines in this chunk
+};
+
+// Read S-records from a file
+// Regular files are memory-mapped, anything else (pipes, character devices)
+// is read into memory once with read(). Empty lines and lines that do not
+// start with 'S' are skipped, malformed records throw SrecError. next()
+// only checks the structure of a line, checksums are verified by
+// SrecRecord::decode().
+class SrecReader {
+	std::string filename;
+	const char *data{nullptr};
+	size_t length{0};
+	bool mapped{false};
+	std::vector<char> storage; // used when the input cannot be mapped
+
+	size_t pos{0};
+	size_t line_number{0};
+
+	static bool next_line(const char *data, size_t length, size_t &pos, size_t &line_number, SrecRecord &record);
+	static SrecChunk parse_chunk(const char *data, size_t length);
+
+	friend class SrecStream;
+
+public:
+	static constexpr size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024; // in bytes
+
+	// "-" reads stdin
+	explicit SrecReader(const std::string &filename);
+	// Parse 'contents' that were already read, 'filename' names them in messages
+	SrecReader(const std::string &filename, std::vector<char> contents);
+	~SrecReader();
+
+	SrecReader(const SrecReader &) = delete;
+	SrecReader &operator=(const SrecReader &) = delete;
+
+	// Get the next record, returns false at the end of the input
+	bool next(SrecRecord &record);
+	// Start reading from the beginning again
+	void rewind();
+
+	// Parse the whole input on a pool of 'threads' threads
+	// The input is split at line boundaries into chunks of about 'chunk_size'
+	// bytes which are decoded concurrently. 'handler' is called on the
+	// calling thread for every chunk in file order, with line numbers
+	// relative to the whole input. threads == 0 uses all hardware threads.
+	// The checksum of every record is verified.
+	void parse_parallel(const std::function<void(const SrecChunk &)> &handler,
+	                    unsigned int threads = 0, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+	std::string_view buffer() const {
+		return std::string_view(data, length);
+	}
+
+	std::string getFilename() const {
+		return filename;
+	}
+
+	// Number of address bytes for the given record type
+	static size_t address_size(Srec::Type type);
+	// Parse a single line (without line ending) into a record
+	static void parse(std::string_view line, size_t line_number, SrecRecord &record);
+};
+
+// Read S-records from a stream, like a pipe, in fixed size blocks
+// Unlike SrecReader the input is never held in memory as a whole, so memory
+// use stays at one block however long the input is. Records point into the
+// block and are only valid until the next call to next(). Lines must fit
+// into a block.
+class SrecStream {
+	std::string filename;
+	int fd{-1};
+	bool owns_fd{true};
+	std::vector<char> buffer;
+	size_t pos{0};      // start of the next line
+	size_t complete{0}; // end of the last complete line in the buffer
+	size_t end{0};      // end of the data in the buffer
+	bool eof{false};
+	size_t line_number{0};
+
+	void refill();
+
+public:
+	static constexpr size_t DEFAULT_BLOCK_SIZE = 1024 * 1024; // in bytes
+
+	// "-" reads stdin
+	explicit SrecStream(const std::string &filename, size_t block_size = DEFAULT_BLOCK_SIZE);
+	~SrecStream();
+
+	SrecStream(const SrecStream &) = delete;
+	SrecStream &operator=(const SrecStream &) = delete;
+
+	// Get the next record, returns false at the end of the input
+	bool next(SrecRecord &record);
+
+	// Parse the rest of the input with 'threads' decoding threads
+	// Like SrecReader::parse_parallel(), but one thread reads the blocks
+	// while the others decode, so reading and decoding overlap. Records in
+	// SrecChunk::others point into the chunk and stay valid during 'handler'.
+	// next() returns false afterwards.
+	void parse_parallel(const std::function<void(const SrecChunk &)> &handler, unsigned int threads = 0);
+
+	std::string getFilename() const {
+		return filename;
+	}
+};
+
+#endif /* READER_HPP_ */
@@ -0,0 +1,63 @@
+#ifndef RING_HPP_
+#define RING_HPP_
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread
+// The producer only writes 'tail' and the consumer only writes 'head', so
+// no locks or read-modify-write operations are needed. The two indices live
+// on separate cache lines to keep the threads from bouncing one line.
+template <class T>
+class SpscRing {
+	static constexpr size_t CACHE_LINE = 64;
+
+	std::vector<T> slots;
+	size_t mask;
+	alignas(CACHE_LINE) std::atomic<size_t> head{0}; // next slot to read
+	alignas(CACHE_LINE) std::atomic<size_t> tail{0}; // next slot to write
+
+	static size_t round_up(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		return size;
+	}
+
+public:
+	// The capacity is rounded up to a power of two
+	explicit SpscRing(size_t capacity) : slots(round_up(capacity)), mask(slots.size() - 1) {}
+
+	SpscRing(const SpscRing &) = delete;
+	SpscRing &operator=(const SpscRing &) = delete;
+
+	// Producer side, returns false if the ring is full
+	bool try_push(T &value) {
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == slots.size()) {
+			return false;
+		}
+		slots[t & mask] = std::move(value);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, returns false if the ring is empty
+	bool try_pop(T &value) {
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = std::move(slots[h & mask]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t capacity() const {
+		return slots.size();
+	}
+};
+
+#endif /* RING_HPP_ */
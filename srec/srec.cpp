@@ -3,9 +3,18 @@
 #include <string>
 #include <sstream>
 #include <iomanip>
-#include <memory>
+#include <array>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hex.hpp"
 #include "srec.hpp"
+#include "stats.hpp"
 
 // Convert a std::string to a hex string
 std::string ASCIIToHexString(const std::string &buffer) {
@@ -18,31 +27,194 @@ std::string ASCIIToHexString(const std::string &buffer) {
 	return ss.str();
 }
 
+size_t encode_record(char type, const uint8_t *record, size_t length, char *out) {
+	if (length > 254) {
+		throw std::invalid_argument("Data size exceeds maximum");
+	}
+
+	const auto count = static_cast<uint8_t>(length + 1); // data + checksum
+	out[0] = 'S';
+	out[1] = type;
+	hex_byte(count, out + 2);
+	unsigned int sum = count + hex_encode(record, length, out + 4);
+	hex_byte(static_cast<uint8_t>(~sum & 0xFF), out + 4 + 2 * length);
+	return 4 + 2 * length + 2;
+}
+
 // Parse an S-record string and return an Srec objec
 SrecFile::SrecFile(const std::string &filename, SrecFile::AddressSize address_size, unsigned int address)
 	: filename(filename),
+	  buffer(DEFAULT_BUFFER_SIZE),
 	  address(address),
 	  exec_address(address),
 	  address_size_bits(address_size)
 {
-	file.open(filename, std::ios::trunc | std::ios::in | std::ios::out);
+	if (filename == "-") {
+		fd = STDOUT_FILENO;
+		owns_fd = false;
+		return;
+	}
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	struct stat st{};
+	seekable_ = fd >= 0 && ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
 }
 
 SrecFile::~SrecFile() {
-	file.close();
+	try {
+		close();
+	} catch (const std::exception &) {
+		// close() must be called explicitly to see write errors
+	}
 }
 
 void SrecFile::close() {
-	file.flush();
-	file.close();
+	if (fd < 0) {
+		return;
+	}
+	int f = fd;
+	try {
+		flush();
+		drain_io();
+		if (sync_on_close && seekable_) {
+			SREC_STATS_TIME(Sync);
+			SREC_STATS_ADD(Syscalls, 1);
+			if (::fsync(f) != 0) {
+				throw std::ios_base::failure("Failed to sync file: " + this->filename);
+			}
+		}
+	} catch (...) {
+		aio.reset();
+		fd = -1;
+		if (owns_fd) {
+			::close(f);
+		}
+		throw;
+	}
+	fd = -1;
+	if (owns_fd && ::close(f) != 0) {
+		throw std::ios_base::failure("Failed to close file: " + this->filename);
+	}
 }
 
 bool SrecFile::is_open() {
-	return file.is_open();
+	return fd >= 0;
 }
 
-unsigned int SrecFile::max_data_bytes_per_record() const {
-	switch (address_size_bits) {
+void SrecFile::flush() {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	if (aio && buffered > 0) {
+		// Hand the buffer to the I/O queue and continue in a free one
+		SREC_STATS_TIME_BYTES(Write, buffered);
+		SREC_STATS_ADD(BytesOut, buffered);
+		if (free_io_buffers.empty()) {
+			wait_io(1);
+		}
+		const size_t index = free_io_buffers.back();
+		free_io_buffers.pop_back();
+		std::swap(buffer, io_buffers[index]);
+		aio->write(fd, io_buffers[index].data(), buffered, static_cast<uint64_t>(written), index);
+		aio->submit();
+		written += static_cast<off_t>(buffered);
+		buffered = 0;
+		return;
+	}
+	write_all(buffer.data(), buffered);
+	buffered = 0;
+}
+
+// Wait for 'min' buffer writes and make their buffers free again
+void SrecFile::wait_io(size_t min) {
+	SREC_STATS_TIME(Write);
+	std::vector<AsyncIo::Completion> done;
+	aio->wait(done, min);
+	for (const auto &completion : done) {
+		free_io_buffers.push_back(completion.tag);
+		if (completion.result < 0) {
+			throw std::ios_base::failure("Failed to write file: " + this->filename);
+		}
+	}
+}
+
+void SrecFile::drain_io() {
+	while (aio && aio->in_flight() > 0) {
+		wait_io(aio->in_flight());
+	}
+}
+
+void SrecFile::set_io_depth(unsigned int depth) {
+	if (!seekable_) {
+		return;
+	}
+	drain_io();
+	aio.reset();
+	io_buffers.clear();
+	free_io_buffers.clear();
+	if (depth == 0) {
+		return;
+	}
+
+	aio = std::make_unique<AsyncIo>(depth);
+	io_buffers.assign(depth, std::vector<char>(buffer.size()));
+	std::vector<iovec> registered{{buffer.data(), buffer.size()}};
+	for (size_t i = 0; i < io_buffers.size(); ++i) {
+		free_io_buffers.push_back(i);
+		registered.push_back({io_buffers[i].data(), io_buffers[i].size()});
+	}
+	// Buffers are only swapped, so the registered memory stays the same
+	aio->register_buffers(registered);
+	aio->register_files({fd});
+}
+
+// Regular files are written at explicit offsets, like the asynchronous writes
+void SrecFile::write_all(const char *data, size_t length) {
+	SREC_STATS_TIME_BYTES(Write, length);
+	const size_t total = length;
+	off_t offset = written;
+	while (length > 0) {
+		ssize_t n = seekable_ ? ::pwrite(fd, data, length, offset) : ::write(fd, data, length);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::ios_base::failure("Failed to write file: " + this->filename);
+		}
+		data += n;
+		offset += n;
+		length -= n;
+	}
+	written += static_cast<off_t>(total);
+	SREC_STATS_ADD(BytesOut, total);
+}
+
+void SrecFile::set_buffer_size(size_t size) {
+	if (size < MAX_LINE_LENGTH + 2) {
+		throw std::invalid_argument("Buffer size must hold at least one record");
+	}
+	if (this->is_open()) {
+		flush();
+		drain_io();
+	}
+	buffer.resize(size);
+	buffer.shrink_to_fit();
+	if (aio) {
+		set_io_depth(aio->depth());
+	}
+}
+
+// Get room for 'length' characters at the end of the buffer
+char *SrecFile::reserve(size_t length) {
+	if (buffer.size() - buffered < length) {
+		flush();
+	}
+	return buffer.data() + buffered;
+}
+
+unsigned int SrecFile::max_data_bytes_per_record(AddressSize address_size) {
+	switch (address_size) {
 		case AddressSize::BITS16:
 			return 255 - 1 - 4 - 1; // max data - byte_count -  address_width - checksum
 		case AddressSize::BITS24:
@@ -54,36 +226,94 @@ unsigned int SrecFile::max_data_bytes_per_record() const {
 }
 
 // Write record data (S1/S2/S3) to file
-void SrecFile::write_record_payload(const std::vector<uint8_t> &buffer) {
-	if (!this->file.is_open()) {
+void SrecFile::write_record_payload(const uint8_t *data, size_t length) {
+	if (!this->is_open()) {
 		throw std::ios_base::failure("File is not open: " + this->filename);
 	}
 
-	// Create the record type based on the address size
-	std::unique_ptr<Srec> record_type;
 	switch (address_size_bits) {
 		case AddressSize::BITS16:
-			record_type = std::make_unique<Srec1>(address, buffer);
+			write_encoded<S1Encoder>(address, data, length);
 			break;
 		case AddressSize::BITS24:
-			record_type = std::make_unique<Srec2>(address, buffer);
+			write_encoded<S2Encoder>(address, data, length);
 			break;
 		case AddressSize::BITS32:
-			record_type = std::make_unique<Srec3>(address, buffer);
+			write_encoded<S3Encoder>(address, data, length);
 			break;
 	}
-	// Write the record to the file
-	this->file << record_type->toString() << std::endl;
-	this->file.flush();
 
 	// Update the record count and address
 	this->record_count++;
-	this->address += buffer.size();
+	this->address += length;
+	SREC_STATS_ADD(Records, 1);
+}
+
+void SrecFile::write_record(AddressSize address_size, unsigned int address, const uint8_t *data, size_t length) {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	switch (address_size) {
+		case AddressSize::BITS16:
+			if (address > 0xFFFF) {
+				throw std::out_of_range("Address does not fit an S1 record");
+			}
+			write_encoded<S1Encoder>(address, data, length);
+			break;
+		case AddressSize::BITS24:
+			if (address > 0xFFFFFF) {
+				throw std::out_of_range("Address does not fit an S2 record");
+			}
+			write_encoded<S2Encoder>(address, data, length);
+			break;
+		case AddressSize::BITS32:
+			write_encoded<S3Encoder>(address, data, length);
+			break;
+	}
+
+	this->record_count++;
+	this->address = address + static_cast<unsigned int>(length);
+	SREC_STATS_ADD(Records, 1);
+}
+
+void SrecFile::write_record_payload(const std::vector<uint8_t> &buffer) {
+	write_record_payload(buffer.data(), buffer.size());
+}
+
+void SrecFile::write_image(const uint8_t *data, size_t length, unsigned int base_address) {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	this->address = base_address;
+	const size_t record_size = max_data_bytes_per_record();
+	for (size_t offset = 0; offset < length; offset += record_size) {
+		write_record_payload(data + offset, std::min(record_size, length - offset));
+	}
+}
+
+void SrecFile::write_lines(const char *text, size_t length, unsigned int records, size_t data_bytes) {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	if (length > buffer.size()) {
+		// Larger than the buffer, write it out without copying
+		flush();
+		write_all(text, length);
+	} else {
+		std::copy(text, text + length, reserve(length));
+		buffered += length;
+	}
+	this->record_count += records;
+	this->address += static_cast<unsigned int>(data_bytes);
+	SREC_STATS_ADD(Records, records);
 }
 
 // Write record count (S5/S6) to file
 void SrecFile::write_record_count() {
-	if (!this->file.is_open()) {
+	if (!this->is_open()) {
 		throw std::ios_base::failure("File is not open: " + this->filename);
 	}
 
@@ -91,63 +321,118 @@ void SrecFile::write_record_count() {
 		throw std::out_of_range("Record count must be less than 0xFFFFFF");
 	}
 
-	// Create the record type based on the record count
-	std::unique_ptr<Srec> record;
+	// The record type depends on the record count
 	if (this->record_count <= 0xFFFF) {
-		record = std::make_unique<Srec5>(this->record_count);
+		write_encoded<S5Encoder>(this->record_count, nullptr, 0);
 	} else {
-		record = std::make_unique<Srec6>(this->record_count);
+		write_encoded<S6Encoder>(this->record_count, nullptr, 0);
 	}
-
-	// Write the record to the file
-	this->file << record->toString() << std::endl;
-	this->file.flush();
 }
 
 // Write record termination (S7/S8/S9) to file
 void SrecFile::write_record_termination() {
-	if (!this->file.is_open()) {
+	if (!this->is_open()) {
 		throw std::ios_base::failure("File is not open: " + this->filename);
 	}
 
-	std::unique_ptr<Srec> record;
 	switch (address_size_bits) {
 		case AddressSize::BITS16:
-			record = std::make_unique<Srec9>(exec_address);
+			write_encoded<S9Encoder>(exec_address, nullptr, 0);
 			break;
 		case AddressSize::BITS24:
-			record = std::make_unique<Srec8>(exec_address);
+			write_encoded<S8Encoder>(exec_address, nullptr, 0);
 			break;
 		case AddressSize::BITS32:
-			record = std::make_unique<Srec7>(exec_address);
+			write_encoded<S7Encoder>(exec_address, nullptr, 0);
 			break;
 	}
-	// Write the record to the file
-	this->file << record->toString() << std::endl;
-	this->file.flush();
 }
 
 void SrecFile::write_header(const std::vector<std::string> &header_data) {
-	if (!this->file.is_open()) {
+	if (!this->is_open()) {
 		throw std::ios_base::failure("File is not open: " + this->filename);
 	}
 
 	// Write the header data to the file
 	for (const std::string &line : header_data) {
 		std::string hexStr = ASCIIToHexString(line);
-		auto record = Srec0(hexStr);
-		this->file << record.toString() << std::endl;
-		this->file.flush();
+		write_encoded<S0Encoder>(0, reinterpret_cast<const uint8_t *>(hexStr.data()), hexStr.size());
 	}
 }
 
 void SrecFile::write_header(const std::vector<uint8_t> &header_data) {
-	if (!this->file.is_open()) {
+	if (!this->is_open()) {
 		throw std::ios_base::failure("File is not open: " + this->filename);
 	}
 
 	// Write the header data to the file
-	auto record = Srec0(header_data);
-	this->file << record.toString() << std::endl;
-	this->file.flush();
+	write_encoded<S0Encoder>(0, header_data.data(), header_data.size());
+}
+
+std::array<uint8_t, 5> crc_header(unsigned int crc) {
+	return {
+		static_cast<uint8_t>(crc >> 24),
+		static_cast<uint8_t>(crc >> 16),
+		static_cast<uint8_t>(crc >> 8),
+		static_cast<uint8_t>(crc),
+		0 // null
+	};
+}
+
+void SrecFile::reserve_crc_header() {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	const auto header = crc_header(0);
+	crc_header_offset = written + static_cast<off_t>(buffered);
+	write_encoded<S0Encoder>(0, header.data(), header.size());
+}
+
+void SrecFile::write_crc_record(unsigned int crc) {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+
+	const auto header = crc_header(crc);
+	write_encoded<S0Encoder>(0, header.data(), header.size());
+}
+
+void SrecFile::write_crc_header(unsigned int crc) {
+	if (!this->is_open()) {
+		throw std::ios_base::failure("File is not open: " + this->filename);
+	}
+	if (crc_header_offset < 0) {
+		throw std::logic_error("No CRC header reserved: " + this->filename);
+	}
+
+	const auto header = crc_header(crc);
+	char line[S0Encoder::MAX_LINE];
+	size_t length = S0Encoder::encode(0, header.data(), header.size(), line);
+
+	// Patch the buffer if the placeholder was not written out yet
+	if (crc_header_offset >= written) {
+		std::copy(line, line + length, buffer.data() + (crc_header_offset - written));
+		return;
+	}
+	if (!seekable_) {
+		throw std::ios_base::failure("Cannot update the CRC header of a stream: " + this->filename);
+	}
+	drain_io();
+
+	const char *data = line;
+	off_t offset = crc_header_offset;
+	while (length > 0) {
+		ssize_t n = ::pwrite(fd, data, length, offset);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::ios_base::failure("Failed to write file: " + this->filename);
+		}
+		data += n;
+		offset += n;
+		length -= n;
+	}
 }
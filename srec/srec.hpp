@@ -7,11 +7,64 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
+#include <array>
+#include <memory>
 #include <cinttypes>
 #include <cstddef>
+#include <stdexcept>
+#include <sys/types.h>
+
+#include "aio.hpp"
+#include "hex.hpp"
 
 std::string ASCIIToHexString(const std::string &buffer);
 
+// Longest record line: S + type + byte count + 255 bytes, no line ending
+constexpr size_t MAX_LINE_LENGTH = 2 + 2 + 255 * 2;
+
+// Encode an S-record line into 'out'
+// 'record' holds the address field followed by the data. The byte count and
+// checksum are computed while the bytes are converted to hex. 'out' must have
+// room for MAX_LINE_LENGTH characters. Returns the number of characters written.
+size_t encode_record(char type, const uint8_t *record, size_t length, char *out);
+
+// Data of the S0 record holding a CRC32: big endian and NUL terminated
+std::array<uint8_t, 5> crc_header(unsigned int crc);
+
+// Non-owning view of bytes, like std::span<const uint8_t> in C++20
+class ByteSpan {
+	const uint8_t *data_{nullptr};
+	size_t size_{0};
+public:
+	constexpr ByteSpan() = default;
+	constexpr ByteSpan(const uint8_t *data, size_t size) : data_(data), size_(size) {};
+	ByteSpan(const std::vector<uint8_t> &data) : data_(data.data()), size_(data.size()) {};
+	template <size_t N>
+	constexpr ByteSpan(const std::array<uint8_t, N> &data) : data_(data.data()), size_(N) {};
+	template <size_t N>
+	constexpr ByteSpan(const uint8_t (&data)[N]) : data_(data), size_(N) {};
+
+	constexpr const uint8_t *data() const {
+		return data_;
+	}
+	constexpr size_t size() const {
+		return size_;
+	}
+	constexpr bool empty() const {
+		return size_ == 0;
+	}
+	constexpr const uint8_t *begin() const {
+		return data_;
+	}
+	constexpr const uint8_t *end() const {
+		return data_ + size_;
+	}
+	// View of 'count' bytes from 'offset', clamped to the end
+	constexpr ByteSpan subspan(size_t offset, size_t count) const {
+		offset = offset < size_ ? offset : size_;
+		return ByteSpan(data_ + offset, count < size_ - offset ? count : size_ - offset);
+	}
+};
 
 // Base class for Srecords
 class Srec {
@@ -28,6 +81,10 @@ public:
 	virtual ~Srec() = default;
 
 	char getTypeChar () const {
+		return type_char(type);
+	}
+
+	static constexpr char type_char(Type type) {
 		switch (type) {
 			case Type::S0:
 				return '0';
@@ -73,26 +130,75 @@ public:
 	// We expect the data to be a vector of bytes which can
 	// include an address and/or data.
 	virtual std::string toString() {
+		char line[MAX_LINE_LENGTH];
+		return std::string(line, encode(line));
+	}
+
+	// Encode the record into 'out' without allocating a string
+	// 'out' must have room for MAX_LINE_LENGTH characters.
+	// Returns the number of characters written.
+	virtual size_t encode(char *out) {
 		std::vector<uint8_t> data = getRecordData();
+		return encode_record(getTypeChar(), data.data(), data.size(), out);
+	}
+
+private:
+	Type type;
+};
+
+// Encoder for one record type with an address field of 'AddressBytes' bytes
+// Everything that depends on the type is resolved at compile time. A record
+// is encoded straight from the caller's bytes into 'out', with the address
+// written big endian in front of the data, so nothing is allocated.
+template <Srec::Type T, size_t AddressBytes>
+struct RecordEncoder {
+	static constexpr Srec::Type TYPE = T;
+	static constexpr char TYPE_CHAR = Srec::type_char(T);
+	static constexpr size_t ADDRESS_SIZE = AddressBytes; // in bytes
+	// The byte count field covers address, data and checksum
+	static constexpr size_t MAX_DATA_SIZE = 255 - AddressBytes - 1;
+
+	// Characters of a record with 'length' data bytes, no line ending
+	static constexpr size_t line_length(size_t length) {
+		return 4 + 2 * (AddressBytes + length + 1);
+	}
 
-		if (data.size() > 255) {
+	static constexpr size_t MAX_LINE = line_length(MAX_DATA_SIZE);
+	static_assert(MAX_LINE <= MAX_LINE_LENGTH);
+
+	// Encode a record into 'out', which must have room for line_length(length)
+	// characters. Returns the number of characters written.
+	static size_t encode(unsigned int address, const uint8_t *data, size_t length, char *out) {
+		if (length > MAX_DATA_SIZE) {
 			throw std::invalid_argument("Data size exceeds maximum");
 		}
 
-		std::stringstream ss;
-		ss << 'S' << getTypeChar()
-		   << std::setfill('0') << std::setw(2) << std::uppercase << std::hex << (data.size() + 1/*data + checksum*/);
-		for (const auto byte : data) {
-			ss << std::setfill('0') << std::setw(2) << std::uppercase << std::hex << static_cast<unsigned int>(byte);
+		const auto count = static_cast<uint8_t>(AddressBytes + length + 1);
+		out[0] = 'S';
+		out[1] = TYPE_CHAR;
+		hex_byte(count, out + 2);
+		unsigned int sum = count;
+		for (size_t i = 0; i < AddressBytes; ++i) {
+			const auto byte = static_cast<uint8_t>(address >> (8 * (AddressBytes - 1 - i)));
+			hex_byte(byte, out + 4 + 2 * i);
+			sum += byte;
 		}
-		ss << std::setfill('0') << std::setw(2) << std::uppercase << std::hex << static_cast<unsigned int>(checksum(data));
-		return ss.str();
+		sum += hex_encode(data, length, out + 4 + 2 * AddressBytes);
+		hex_byte(static_cast<uint8_t>(~sum & 0xFF), out + line_length(length) - 2);
+		return line_length(length);
 	}
-
-private:
-	Type type;
 };
 
+using S0Encoder = RecordEncoder<Srec::Type::S0, 2>;
+using S1Encoder = RecordEncoder<Srec::Type::S1, 2>;
+using S2Encoder = RecordEncoder<Srec::Type::S2, 3>;
+using S3Encoder = RecordEncoder<Srec::Type::S3, 4>;
+using S5Encoder = RecordEncoder<Srec::Type::S5, 2>;
+using S6Encoder = RecordEncoder<Srec::Type::S6, 3>;
+using S7Encoder = RecordEncoder<Srec::Type::S7, 4>;
+using S8Encoder = RecordEncoder<Srec::Type::S8, 3>;
+using S9Encoder = RecordEncoder<Srec::Type::S9, 2>;
+
 // S0 record
 // Contains the header information for the file
 // The header information is a series of ASCII characters
@@ -125,6 +231,10 @@ public:
 
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S0Encoder::encode(0, header.data(), header.size(), out);
+	}
 };
 
 // S1 record
@@ -159,6 +269,10 @@ public:
 		record.insert(record.end(), data.begin(), data.end());
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S1Encoder::encode(address, data.data(), data.size(), out);
+	}
 };
 
 // S2 record
@@ -170,7 +284,7 @@ public:
 	static constexpr size_t ADDRESS_SIZE = 3; //in bytes
 
 	Srec2(unsigned int address, const std::vector<uint8_t> &data) : Srec(Srec::Type::S2), address(address), data(data) {};
-	Srec2(unsigned int address, const std::string &data) : Srec(Srec::Type::S1), address(address) {
+	Srec2(unsigned int address, const std::string &data) : Srec(Srec::Type::S2), address(address) {
 		for (const auto c : data) {
 			this->data.push_back(static_cast<uint8_t>(c));
 		}
@@ -194,6 +308,10 @@ public:
 		record.insert(record.end(), data.begin(), data.end());
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S2Encoder::encode(address, data.data(), data.size(), out);
+	}
 };
 
 // S3 record
@@ -205,7 +323,7 @@ public:
 	static constexpr size_t ADDRESS_SIZE = 4; //in bytes
 
 	Srec3(unsigned int address, const std::vector<uint8_t> &data) : Srec(Srec::Type::S3), address(address), data(data) {};
-	Srec3(unsigned int address, const std::string &data) : Srec(Srec::Type::S1), address(address) {
+	Srec3(unsigned int address, const std::string &data) : Srec(Srec::Type::S3), address(address) {
 		for (const auto c : data) {
 			this->data.push_back(static_cast<uint8_t>(c));
 		}
@@ -230,6 +348,10 @@ public:
 		record.insert(record.end(), data.begin(), data.end());
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S3Encoder::encode(address, data.data(), data.size(), out);
+	}
 };
 
 // S5 record
@@ -252,6 +374,10 @@ public:
 		record.push_back(count & 0xFF);
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S5Encoder::encode(count, nullptr, 0, out);
+	}
 };
 
 // S6 record
@@ -275,6 +401,10 @@ public:
 		record.push_back(count & 0xFF);
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S6Encoder::encode(count, nullptr, 0, out);
+	}
 };
 
 // S7 record
@@ -297,6 +427,10 @@ public:
 		record.push_back(address & 0xFF);
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S7Encoder::encode(address, nullptr, 0, out);
+	}
 };
 
 // S8 record
@@ -318,6 +452,10 @@ public:
 		record.push_back(address & 0xFF);
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S8Encoder::encode(address, nullptr, 0, out);
+	}
 };
 
 // S9 record
@@ -338,6 +476,10 @@ public:
 		record.push_back(address & 0xFF);
 		return record;
 	}
+
+	size_t encode(char *out) override {
+		return S9Encoder::encode(address, nullptr, 0, out);
+	}
 };
 
 
@@ -347,27 +489,120 @@ public:
 		BITS16, BITS24, BITS32
 	};
 
+	static constexpr size_t DEFAULT_BUFFER_SIZE = 1024 * 1024; // in bytes
+
 private:
 	std::string filename;
-	std::fstream file;
+	int fd{-1};
+	bool owns_fd{true}; // false for stdout
+	bool seekable_{false};
+
+	// Records are collected here and written out in large blocks
+	std::vector<char> buffer;
+	size_t buffered{0};
+	off_t written{0}; // bytes already written to the file
+	bool sync_on_close{false};
+
+	off_t crc_header_offset{-1}; // file offset of the reserved CRC header
+
+	// Write-behind: full buffers are written asynchronously while the next
+	// one is filled, see set_io_depth()
+	std::vector<std::vector<char>> io_buffers; // buffers being written or free
+	std::vector<size_t> free_io_buffers;
+	std::unique_ptr<AsyncIo> aio; // destroyed first, it waits for the writes
+	void wait_io(size_t min);
+	void drain_io();
 
 	unsigned int address; // current address
 	unsigned int exec_address; // execution address
 	AddressSize address_size_bits;
 
 	unsigned int record_count{0};
-
+	bool crlf{false};
+
+	char *reserve(size_t length);
+	void write_all(const char *data, size_t length);
+	// Encode a record straight into the output buffer
+	template <class Encoder>
+	void write_encoded(unsigned int address, const uint8_t *data, size_t length) {
+		char *line = reserve(Encoder::line_length(length) + 2);
+		size_t n = Encoder::encode(address, data, length, line);
+		if (crlf) {
+			line[n++] = '\r';
+		}
+		line[n] = '\n';
+		buffered += n + 1;
+	}
 
 public:
+	// "-" writes to stdout, which is flushed but left open by close()
 	SrecFile(const std::string &filename, AddressSize address_size, unsigned int address = 0);
     ~SrecFile();
     void close();
 	bool is_open();
-	unsigned int max_data_bytes_per_record() const;
+	unsigned int max_data_bytes_per_record() const {
+		return max_data_bytes_per_record(address_size_bits);
+	}
+	static unsigned int max_data_bytes_per_record(AddressSize address_size);
+
+	// Write all buffered records to the file
+	void flush();
+	// Size of the output buffer, flushes pending records first
+	void set_buffer_size(size_t size);
+	// fsync the file when it is closed, ignored unless it is a regular file
+	void set_sync_on_close(bool sync) {
+		sync_on_close = sync;
+	}
+	// End lines with "\r\n" instead of "\n"
+	void set_crlf(bool enable) {
+		crlf = enable;
+	}
+	// Keep up to 'depth' buffer writes in flight, 0 writes synchronously
+	// Uses io_uring with registered buffers where available and pwrite()
+	// otherwise. Each write takes a buffer of the current buffer size.
+	// Ignored unless the output is a regular file.
+	void set_io_depth(unsigned int depth);
 
 	void write_header(const std::vector<std::string> &header_data);
 	void write_header(const std::vector<uint8_t> &header_data);
+
+	// Reserve a fixed-width S0 record for a CRC32 of the data
+	// The record is written with a zero CRC and filled in later with
+	// write_crc_header(), so the file does not need to be rewritten.
+	void reserve_crc_header();
+	void write_crc_header(unsigned int crc);
+	// Append an S0 record with a CRC32 of the data
+	// For outputs that cannot seek, where the reserved header may already
+	// be written out when the CRC is known.
+	void write_crc_record(unsigned int crc);
+	// True if the output is a regular file that reserved records can be patched in
+	bool seekable() const {
+		return seekable_;
+	}
 	void write_record_payload(const std::vector<uint8_t> &buffer);
+	// Write one data record from any buffer, e.g. mapped or on the stack
+	// 'length' must not exceed max_data_bytes_per_record().
+	void write_record_payload(const uint8_t *data, size_t length);
+	void write_record_payload(ByteSpan data) {
+		write_record_payload(data.data(), data.size());
+	}
+	// Write a whole image starting at 'base_address'
+	// The data is split into records of max_data_bytes_per_record() bytes,
+	// the last one may be shorter. Nothing is copied.
+	void write_image(const uint8_t *data, size_t length, unsigned int base_address);
+	void write_image(ByteSpan data, unsigned int base_address) {
+		write_image(data.data(), data.size(), base_address);
+	}
+	// Write one data record of any type at any address
+	// For files that mix S1/S2/S3 records or are not in address order;
+	// the current address continues after the record. 'address' must fit
+	// 'address_size' and 'length' must not exceed
+	// max_data_bytes_per_record(address_size).
+	void write_record(AddressSize address_size, unsigned int address, const uint8_t *data, size_t length);
+	// Append data records that were already encoded, e.g. by encode_image()
+	// 'text' holds 'records' complete lines for 'data_bytes' bytes of data
+	// that continue at the current address.
+	void write_lines(const char *text, size_t length, unsigned int records, size_t data_bytes);
 	void write_record_count();
 	void write_record_termination();
 
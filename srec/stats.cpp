@@ -0,0 +1,553 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "perf.hpp"
+#include "stats.hpp"
+
+namespace stats {
+
+namespace detail {
+std::atomic<bool> active{false};
+std::atomic<bool> perf_active{false};
+} // namespace detail
+
+namespace {
+
+constexpr size_t PHASES = static_cast<size_t>(Phase::COUNT);
+constexpr size_t COUNTERS = static_cast<size_t>(Counter::COUNT);
+
+// One cache line each, threads updating different values do not contend
+struct alignas(64) Value {
+	std::atomic<uint64_t> value{0};
+};
+
+struct PhaseValues {
+	Value calls;
+	Value nanoseconds;
+	Value bytes;
+	Value events[PERF_EVENTS];
+};
+
+PhaseValues phases[PHASES];
+Value counters[COUNTERS];
+std::atomic<uint64_t> started{0};
+std::atomic<uint64_t> stopped{0};
+
+// Hardware counters of the whole run, which include the time between phases
+bool perf_requested{false};
+std::unique_ptr<PerfCounters> process_counters;
+uint64_t perf_begin[PERF_EVENTS];
+uint64_t perf_totals[PERF_EVENTS];
+std::string perf_error_text;
+
+double seconds(uint64_t nanoseconds) {
+	return static_cast<double>(nanoseconds) / 1e9;
+}
+
+struct TraceEvent {
+	Phase phase;
+	uint64_t begin;
+	uint64_t end;
+	uint64_t bytes;
+};
+
+// Events of one thread, appended only by that thread
+// The events are kept in fixed size blocks, so appending never moves them.
+struct TraceBuffer {
+	static constexpr size_t BLOCK_EVENTS = 4096;
+	static constexpr size_t MAX_EVENTS = 1024 * BLOCK_EVENTS;
+
+	size_t tid{0};
+	const char *name{nullptr};
+	std::vector<std::unique_ptr<TraceEvent[]>> blocks;
+	std::atomic<size_t> size{0};
+	size_t dropped{0};
+
+	void push(const TraceEvent &event) {
+		const size_t n = size.load(std::memory_order_relaxed);
+		if (n == MAX_EVENTS) {
+			dropped++;
+			return;
+		}
+		if (n == blocks.size() * BLOCK_EVENTS) {
+			blocks.push_back(std::make_unique<TraceEvent[]>(BLOCK_EVENTS));
+		}
+		blocks[n / BLOCK_EVENTS][n % BLOCK_EVENTS] = event;
+		size.store(n + 1, std::memory_order_release);
+	}
+
+	const TraceEvent &operator[](size_t i) const {
+		return blocks[i / BLOCK_EVENTS][i % BLOCK_EVENTS];
+	}
+};
+
+std::atomic<bool> tracing{false};
+// Taken once per thread and trace to register its buffer, not per event
+std::mutex trace_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+// Buffers of an earlier trace are gone, threads notice by the generation
+std::atomic<uint64_t> trace_generation{1};
+
+TraceBuffer &thread_buffer() {
+	thread_local TraceBuffer *buffer = nullptr;
+	thread_local uint64_t generation = 0;
+	const uint64_t current = trace_generation.load(std::memory_order_acquire);
+	if (generation != current) {
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		trace_buffers.push_back(std::make_unique<TraceBuffer>());
+		buffer = trace_buffers.back().get();
+		buffer->tid = trace_buffers.size();
+		generation = current;
+	}
+	return *buffer;
+}
+
+// Trace timestamps are in microseconds
+double microseconds(uint64_t nanoseconds) {
+	return static_cast<double>(nanoseconds) / 1e3;
+}
+
+double ratio(uint64_t value, uint64_t per) {
+	return per > 0 ? static_cast<double>(value) / static_cast<double>(per) : 0;
+}
+
+// Hardware events by phase and per input byte and record, unavailable ones as "-"
+void report_perf_table(std::ostream &out) {
+	const auto &events = PerfCounters::hardware_events();
+	auto cell = [&out](size_t event, uint64_t value, int width) {
+		out << std::setw(width);
+		if (process_counters->available(event)) {
+			out << value;
+		} else {
+			out << "-";
+		}
+	};
+	auto row = [&](const char *label, const std::function<uint64_t(size_t)> &value, uint64_t bytes) {
+		out << std::left << std::setw(14) << label << std::right;
+		for (size_t i = 0; i < PERF_EVENTS; ++i) {
+			cell(i, value(i), 16);
+		}
+		// instructions per cycle and cycles per byte
+		out << std::setprecision(2) << std::setw(8);
+		if (process_counters->available(0) && process_counters->available(1) && value(0) > 0) {
+			out << ratio(value(1), value(0));
+		} else {
+			out << "-";
+		}
+		out << std::setw(14);
+		if (process_counters->available(0) && bytes > 0) {
+			out << ratio(value(0), bytes);
+		} else {
+			out << "-";
+		}
+		out << std::endl;
+	};
+
+	out << std::left << std::setw(14) << "PHASE" << std::right;
+	for (const auto &event : events) {
+		out << std::setw(16) << event.name;
+	}
+	out << std::setw(8) << "IPC" << std::setw(14) << "CYCLES/BYTE" << std::endl;
+	for (size_t p = 0; p < PHASES; ++p) {
+		const auto phase = static_cast<Phase>(p);
+		if (calls(phase) > 0) {
+			row(name(phase), [phase](size_t i) { return perf_count(phase, i); }, bytes(phase));
+		}
+	}
+	row("run", perf_total, count(Counter::BytesIn));
+
+	// The whole run per input byte and per record
+	const uint64_t records = count(Counter::Records);
+	const uint64_t bytes_in = count(Counter::BytesIn);
+	for (const auto &per : {std::make_pair("per byte", bytes_in), std::make_pair("per record", records)}) {
+		out << std::left << std::setw(14) << per.first << std::right;
+		for (size_t i = 0; i < PERF_EVENTS; ++i) {
+			out << std::setw(16);
+			if (process_counters->available(i) && per.second > 0) {
+				out << std::setprecision(3) << ratio(perf_total(i), per.second);
+			} else {
+				out << "-";
+			}
+		}
+		out << std::endl;
+	}
+}
+
+void report_perf_json(std::ostream &out) {
+	if (!perf_recorded()) {
+		out << "{\"error\":\"" << perf_error() << "\"}";
+		return;
+	}
+	const auto &events = PerfCounters::hardware_events();
+	// null for unavailable events
+	auto values = [&](const std::function<double(size_t)> &value) {
+		out << "{";
+		for (size_t i = 0; i < PERF_EVENTS; ++i) {
+			out << (i > 0 ? "," : "") << "\"" << events[i].name << "\":";
+			if (process_counters->available(i)) {
+				out << value(i);
+			} else {
+				out << "null";
+			}
+		}
+		out << "}";
+	};
+	const uint64_t records = count(Counter::Records);
+	const uint64_t bytes_in = count(Counter::BytesIn);
+	out << std::setprecision(0) << "{\"run\":";
+	values([](size_t i) { return static_cast<double>(perf_total(i)); });
+	out << std::setprecision(6) << ",\"per_byte\":";
+	values([bytes_in](size_t i) { return ratio(perf_total(i), bytes_in); });
+	out << ",\"per_record\":";
+	values([records](size_t i) { return ratio(perf_total(i), records); });
+	out << std::setprecision(0) << ",\"phases\":{";
+	for (size_t p = 0; p < PHASES; ++p) {
+		const auto phase = static_cast<Phase>(p);
+		out << (p > 0 ? "," : "") << "\"" << name(phase) << "\":";
+		values([phase](size_t i) { return static_cast<double>(perf_count(phase, i)); });
+	}
+	out << "}}";
+}
+
+} // namespace
+
+void detail::add(Counter counter, uint64_t value) {
+	counters[static_cast<size_t>(counter)].value.fetch_add(value, std::memory_order_relaxed);
+}
+
+// Each thread reads its own counters, opened by its first timed phase
+void detail::perf_read(uint64_t *values) {
+	thread_local std::unique_ptr<PerfCounters> counters;
+	if (!counters) {
+		counters = std::make_unique<PerfCounters>(PerfCounters::hardware_events(), PerfCounters::Scope::Thread);
+	}
+	counters->read(values);
+}
+
+void detail::finish(Phase phase, uint64_t begin, uint64_t bytes, const uint64_t *perf_begin) {
+	const uint64_t end = now();
+	auto &values = phases[static_cast<size_t>(phase)];
+	values.calls.value.fetch_add(1, std::memory_order_relaxed);
+	values.nanoseconds.value.fetch_add(end - begin, std::memory_order_relaxed);
+	values.bytes.value.fetch_add(bytes, std::memory_order_relaxed);
+	if (perf_begin != nullptr) {
+		uint64_t perf_end[PERF_EVENTS];
+		perf_read(perf_end);
+		for (size_t i = 0; i < PERF_EVENTS; ++i) {
+			values.events[i].value.fetch_add(perf_end[i] - perf_begin[i], std::memory_order_relaxed);
+		}
+	}
+	if (tracing.load(std::memory_order_relaxed)) {
+		thread_buffer().push({phase, begin, end, bytes});
+	}
+}
+
+uint64_t now() {
+	timespec ts{};
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+void start(bool trace, bool perf) {
+	{
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		trace_buffers.clear();
+		trace_generation++;
+	}
+	tracing = trace;
+	for (auto &values : phases) {
+		values.calls.value = 0;
+		values.nanoseconds.value = 0;
+		values.bytes.value = 0;
+		for (auto &event : values.events) {
+			event.value = 0;
+		}
+	}
+	for (auto &counter : counters) {
+		counter.value = 0;
+	}
+	// Opened before the tool starts its threads, so they inherit the counters
+	perf_requested = perf;
+	perf_error_text.clear();
+	process_counters.reset();
+	std::fill(perf_totals, perf_totals + PERF_EVENTS, 0);
+	if (perf) {
+		process_counters = std::make_unique<PerfCounters>(PerfCounters::hardware_events(), PerfCounters::Scope::Process);
+		if (process_counters->any_available()) {
+			process_counters->read(perf_begin);
+		} else {
+			perf_error_text = process_counters->error();
+			process_counters.reset();
+		}
+	}
+	detail::perf_active = process_counters != nullptr;
+
+	stopped = 0;
+	started = now();
+	detail::active = true;
+}
+
+void stop() {
+	if (detail::active.exchange(false)) {
+		stopped = now();
+	}
+	tracing = false;
+	detail::perf_active = false;
+	if (process_counters) {
+		process_counters->read(perf_totals);
+		for (size_t i = 0; i < PERF_EVENTS; ++i) {
+			perf_totals[i] -= perf_begin[i];
+		}
+	}
+}
+
+uint64_t count(Counter counter) {
+	return counters[static_cast<size_t>(counter)].value.load(std::memory_order_relaxed);
+}
+
+uint64_t calls(Phase phase) {
+	return phases[static_cast<size_t>(phase)].calls.value.load(std::memory_order_relaxed);
+}
+
+uint64_t nanoseconds(Phase phase) {
+	return phases[static_cast<size_t>(phase)].nanoseconds.value.load(std::memory_order_relaxed);
+}
+
+uint64_t bytes(Phase phase) {
+	return phases[static_cast<size_t>(phase)].bytes.value.load(std::memory_order_relaxed);
+}
+
+bool perf_recorded() {
+	return process_counters != nullptr;
+}
+
+const std::string &perf_error() {
+	return perf_error_text;
+}
+
+uint64_t perf_count(Phase phase, size_t event) {
+	return phases[static_cast<size_t>(phase)].events[event].value.load(std::memory_order_relaxed);
+}
+
+uint64_t perf_total(size_t event) {
+	return perf_totals[event];
+}
+
+uint64_t wall_nanoseconds() {
+	if (started == 0) {
+		return 0;
+	}
+	return (enabled() ? now() : stopped.load()) - started;
+}
+
+const char *name(Phase phase) {
+	switch (phase) {
+		case Phase::Read:
+			return "read";
+		case Phase::Decode:
+			return "decode";
+		case Phase::Encode:
+			return "encode";
+		case Phase::Crc:
+			return "crc";
+		case Phase::Write:
+			return "write";
+		case Phase::Sync:
+			return "sync";
+		case Phase::Wait:
+			return "wait";
+		default:
+			return "?";
+	}
+}
+
+const char *name(Counter counter) {
+	switch (counter) {
+		case Counter::BytesIn:
+			return "bytes_in";
+		case Counter::BytesOut:
+			return "bytes_out";
+		case Counter::Records:
+			return "records";
+		case Counter::Lines:
+			return "lines";
+		case Counter::Syscalls:
+			return "syscalls";
+		case Counter::Allocations:
+			return "allocations";
+		default:
+			return "?";
+	}
+}
+
+void report(std::ostream &out, Format format) {
+	const uint64_t wall = wall_nanoseconds();
+	const std::ios_base::fmtflags flags = out.flags();
+	const std::streamsize precision = out.precision();
+
+	if (format == Format::Json) {
+		out << std::fixed << std::setprecision(6);
+		out << "{\"wall_seconds\":" << seconds(wall) << ",\"phases\":{";
+		for (size_t i = 0; i < PHASES; ++i) {
+			const auto phase = static_cast<Phase>(i);
+			out << (i > 0 ? "," : "") << "\"" << name(phase) << "\":{\"calls\":" << calls(phase)
+			    << ",\"seconds\":" << seconds(nanoseconds(phase)) << "}";
+		}
+		out << "},\"counters\":{";
+		for (size_t i = 0; i < COUNTERS; ++i) {
+			const auto counter = static_cast<Counter>(i);
+			out << (i > 0 ? "," : "") << "\"" << name(counter) << "\":" << count(counter);
+		}
+		out << "}";
+		if (perf_requested) {
+			out << ",\"perf\":";
+			report_perf_json(out);
+		}
+		out << "}" << std::endl;
+	} else {
+		// Phase times are summed over threads, their share is of the wall time
+		out << std::left << std::setw(14) << "PHASE" << std::right << std::setw(10) << "CALLS" << std::setw(14)
+		    << "TIME ms" << std::setw(10) << "SHARE" << std::endl;
+		out << std::fixed;
+		for (size_t i = 0; i < PHASES; ++i) {
+			const auto phase = static_cast<Phase>(i);
+			const double share = wall > 0 ? 100.0 * static_cast<double>(nanoseconds(phase)) / static_cast<double>(wall) : 0;
+			out << std::left << std::setw(14) << name(phase) << std::right << std::setw(10) << calls(phase)
+			    << std::setw(14) << std::setprecision(3) << static_cast<double>(nanoseconds(phase)) / 1e6
+			    << std::setw(9) << std::setprecision(1) << share << "%" << std::endl;
+		}
+		out << std::left << std::setw(14) << "COUNTER" << std::right << std::setw(16) << "VALUE" << std::setw(16)
+		    << "PER SECOND" << std::endl;
+		for (size_t i = 0; i < COUNTERS; ++i) {
+			const auto counter = static_cast<Counter>(i);
+			const double rate = wall > 0 ? static_cast<double>(count(counter)) / seconds(wall) : 0;
+			out << std::left << std::setw(14) << name(counter) << std::right << std::setw(16) << count(counter)
+			    << std::setw(16) << std::setprecision(0) << rate << std::endl;
+		}
+		out << std::left << std::setw(14) << "wall" << std::right << std::setw(14) << std::setprecision(3)
+		    << static_cast<double>(wall) / 1e6 << " ms" << std::endl;
+		if (perf_recorded()) {
+			report_perf_table(out);
+		} else if (perf_requested) {
+			out << "hardware counters unavailable: " << perf_error() << std::endl;
+		}
+	}
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+void name_thread(const char *name) {
+	if (tracing.load(std::memory_order_relaxed)) {
+		thread_buffer().name = name;
+	}
+}
+
+size_t trace_events() {
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	size_t events = 0;
+	for (const auto &buffer : trace_buffers) {
+		events += buffer->size.load(std::memory_order_acquire);
+	}
+	return events;
+}
+
+void write_trace(std::ostream &out) {
+	const std::ios_base::fmtflags flags = out.flags();
+	const std::streamsize precision = out.precision();
+	const long pid = static_cast<long>(::getpid());
+	const uint64_t origin = started;
+
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	size_t dropped = 0;
+	out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+	for (size_t i = 0; i < trace_buffers.size(); ++i) {
+		const TraceBuffer &buffer = *trace_buffers[i];
+		out << (i > 0 ? ",\n" : "\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+		    << ",\"tid\":" << buffer.tid << ",\"args\":{\"name\":\"";
+		if (buffer.name != nullptr) {
+			out << buffer.name;
+		} else {
+			out << "thread " << buffer.tid;
+		}
+		out << "\"}}";
+
+		// Complete events, each is the begin and the end of a phase
+		const size_t size = buffer.size.load(std::memory_order_acquire);
+		for (size_t j = 0; j < size; ++j) {
+			const TraceEvent &event = buffer[j];
+			out << ",\n{\"name\":\"" << name(event.phase) << "\",\"cat\":\"srec\",\"ph\":\"X\",\"ts\":"
+			    << microseconds(event.begin - origin) << ",\"dur\":" << microseconds(event.end - event.begin)
+			    << ",\"pid\":" << pid << ",\"tid\":" << buffer.tid;
+			if (event.bytes != 0) {
+				out << ",\"args\":{\"bytes\":" << event.bytes << "}";
+			}
+			out << "}";
+		}
+		dropped += buffer.dropped;
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" << dropped << "}}" << std::endl;
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+Session::~Session() {
+	if (!running) {
+		return;
+	}
+	stop();
+	try {
+		if (print) {
+			stats::report(std::cerr, format);
+		}
+		if (!trace_file.empty()) {
+			std::ofstream out(trace_file);
+			write_trace(out);
+			out.close();
+			if (!out) {
+				std::cerr << "Failed to write trace: " << trace_file << std::endl;
+			}
+		}
+	} catch (const std::exception &) {
+		// nothing left to report the error to
+	}
+}
+
+void Session::report(Format format) {
+	print = true;
+	this->format = format;
+}
+
+void Session::trace(const std::string &filename) {
+	trace_file = filename;
+}
+
+void Session::perf() {
+	perf_ = true;
+	print = true;
+}
+
+void Session::start() {
+	if (!print && trace_file.empty()) {
+		return;
+	}
+	if (!compiled_in()) {
+		std::cerr << "Statistics are not compiled in, configure with -DENABLE_STATS=ON" << std::endl;
+		return;
+	}
+	running = true;
+	stats::start(!trace_file.empty(), perf_);
+	name_thread("main");
+}
+
+} // namespace stats
@@ -0,0 +1,189 @@
+#ifndef STATS_HPP_
+#define STATS_HPP_
+
+#include <atomic>
+#include <iosfwd>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Per-phase timers and counters of one run
+// The library is instrumented with the SREC_STATS_* macros below. They are
+// compiled in only when the build defines SREC_ENABLE_STATS (CMake option
+// ENABLE_STATS) and expand to nothing otherwise. Even when compiled in,
+// nothing is recorded until a Session is started, so a tool turns the
+// statistics on per run. Phases are timed on every thread that runs them,
+// so with several threads their sum can exceed the wall time.
+// A trace additionally keeps every timed phase with its thread, start and
+// duration, to be viewed as a timeline in Perfetto or chrome://tracing.
+// With hardware counters every phase also counts cycles, instructions,
+// cache misses and branch misses (see PerfCounters).
+namespace stats {
+
+enum class Phase {
+	Read,   // reading the input
+	Decode, // parsing and hex decoding records
+	Encode, // formatting records
+	Crc,    // CRC32 of the data
+	Write,  // writing the output
+	Sync,   // fsync() and msync()
+	Wait,   // blocked on a full or empty pipeline queue
+	COUNT
+};
+
+enum class Counter {
+	BytesIn,
+	BytesOut,
+	Records,
+	Lines,
+	Syscalls, // reads, writes, maps, syncs and io_uring submissions
+	Allocations, // counted only in programs that link srec_alloc_stats
+	COUNT
+};
+
+enum class Format {
+	Table,
+	Json
+};
+
+// Hardware counters per phase, PerfCounters::hardware_events()
+constexpr size_t PERF_EVENTS = 4;
+
+constexpr bool compiled_in() {
+#ifdef SREC_ENABLE_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+namespace detail {
+extern std::atomic<bool> active;
+extern std::atomic<bool> perf_active;
+void add(Counter counter, uint64_t value);
+void perf_read(uint64_t *values);
+void finish(Phase phase, uint64_t begin, uint64_t bytes, const uint64_t *perf_begin);
+} // namespace detail
+
+inline bool enabled() {
+	return detail::active.load(std::memory_order_relaxed);
+}
+
+inline void add(Counter counter, uint64_t value) {
+	if (enabled()) {
+		detail::add(counter, value);
+	}
+}
+
+// Monotonic clock in nanoseconds
+uint64_t now();
+
+// Start and stop recording, start() clears all values and the trace
+void start(bool trace = false, bool perf = false);
+void stop();
+
+uint64_t count(Counter counter);
+uint64_t calls(Phase phase);
+uint64_t nanoseconds(Phase phase);
+// Bytes given to the phase's timers
+uint64_t bytes(Phase phase);
+// Between start() and stop(), or until now while recording
+uint64_t wall_nanoseconds();
+
+const char *name(Phase phase);
+const char *name(Counter counter);
+
+// True if the run counts hardware events, otherwise why not
+bool perf_recorded();
+const std::string &perf_error();
+// Hardware event 'event' during 'phase', or during the whole run
+uint64_t perf_count(Phase phase, size_t event);
+uint64_t perf_total(size_t event);
+
+void report(std::ostream &out, Format format);
+
+// Name the calling thread in the trace
+void name_thread(const char *name);
+// Events traced since start(true)
+size_t trace_events();
+// Write the trace as Chrome trace-event JSON
+// Every event is buffered by its own thread without locking, so the
+// threads that recorded them must have finished.
+void write_trace(std::ostream &out);
+
+// Adds the time from its construction to its destruction to a phase
+// 'bytes' is shown with the phase in a trace.
+class Timer {
+	Phase phase;
+	uint64_t begin{0};
+	uint64_t bytes;
+	bool counting{false};
+	uint64_t events[PERF_EVENTS];
+
+public:
+	explicit Timer(Phase phase, uint64_t bytes = 0) : phase(phase), bytes(bytes) {
+		if (enabled()) {
+			if (detail::perf_active.load(std::memory_order_relaxed)) {
+				detail::perf_read(events);
+				counting = true;
+			}
+			begin = now();
+		}
+	}
+	~Timer() {
+		if (begin != 0) {
+			detail::finish(phase, begin, bytes, counting ? events : nullptr);
+		}
+	}
+
+	Timer(const Timer &) = delete;
+	Timer &operator=(const Timer &) = delete;
+};
+
+// Records the statistics of a tool run and reports them when it goes
+// out of scope, however the run ends
+class Session {
+	bool running{false};
+	bool print{false};
+	bool perf_{false};
+	Format format{Format::Table};
+	std::string trace_file;
+
+public:
+	Session() = default;
+	~Session();
+
+	Session(const Session &) = delete;
+	Session &operator=(const Session &) = delete;
+
+	// Print the statistics to stderr
+	void report(Format format);
+	// Write a trace to 'filename'
+	void trace(const std::string &filename);
+	// Count hardware events per phase, printed with the statistics
+	void perf();
+	// Start recording if report(), trace() or perf() asked for it. Without
+	// SREC_ENABLE_STATS it only prints a note that nothing is recorded.
+	void start();
+};
+
+} // namespace stats
+
+#ifdef SREC_ENABLE_STATS
+#define SREC_STATS_CONCAT_(a, b) a##b
+#define SREC_STATS_CONCAT(a, b) SREC_STATS_CONCAT_(a, b)
+// Time the rest of the enclosing scope
+#define SREC_STATS_TIME(phase) ::stats::Timer SREC_STATS_CONCAT(stats_timer_, __LINE__)(::stats::Phase::phase)
+// Time the rest of the enclosing scope, which processes 'bytes'
+#define SREC_STATS_TIME_BYTES(phase, bytes) \
+	::stats::Timer SREC_STATS_CONCAT(stats_timer_, __LINE__)(::stats::Phase::phase, static_cast<uint64_t>(bytes))
+#define SREC_STATS_ADD(counter, value) ::stats::add(::stats::Counter::counter, static_cast<uint64_t>(value))
+#define SREC_STATS_THREAD(name) ::stats::name_thread(name)
+#else
+#define SREC_STATS_TIME(phase) ((void)0)
+#define SREC_STATS_TIME_BYTES(phase, bytes) ((void)0)
+#define SREC_STATS_ADD(counter, value) ((void)0)
+#define SREC_STATS_THREAD(name) ((void)0)
+#endif
+
+#endif /* STATS_HPP_ */
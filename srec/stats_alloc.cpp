@@ -0,0 +1,132 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "stats.hpp"
+#include "stats_alloc.hpp"
+
+// Replaces the global allocation functions to count allocations
+// Linked into the tools in ENABLE_STATS builds, the benchmark and the
+// tests; a program can have only one replacement. Every form is replaced,
+// so nothing allocated here is freed by another implementation, and all of
+// them forward to the counted plain or aligned operator new.
+
+namespace {
+std::atomic<uint64_t> allocation_count{0};
+
+void count() {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	SREC_STATS_ADD(Allocations, 1);
+}
+} // namespace
+
+uint64_t stats::allocations() {
+	return allocation_count.load(std::memory_order_relaxed);
+}
+
+void *operator new(std::size_t size) {
+	count();
+	if (void *p = std::malloc(size != 0 ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+	count();
+	const size_t alignment = static_cast<size_t>(align);
+	if (void *p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+	return ::operator new(size);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+	return ::operator new(size, align);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+	try {
+		return ::operator new(size);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+	return ::operator new(size, std::nothrow);
+}
+
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+	try {
+		return ::operator new(size, align);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+	return ::operator new(size, align, std::nothrow);
+}
+
+// GCC sees the replaced operator new inlined into callers and takes this
+// free() for a mismatched deallocation, which it is not
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// The other forms forward, so only one function pairs new with free()
+void operator delete(void *p, std::size_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+	::operator delete(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+	::operator delete(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+	::operator delete(p);
+}
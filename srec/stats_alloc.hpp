@@ -0,0 +1,18 @@
+#ifndef STATS_ALLOC_HPP_
+#define STATS_ALLOC_HPP_
+
+#include <cstdint>
+
+// Allocation counting for programs that link srec_alloc_stats
+// stats_alloc.cpp replaces the global allocation functions, so only a
+// program that links it has allocations(). Every allocation is also added
+// to the Allocations counter of a running stats::Session when the
+// statistics are compiled in.
+namespace stats {
+
+// Allocations of the process so far
+uint64_t allocations();
+
+} // namespace stats
+
+#endif /* STATS_ALLOC_HPP_ */
@@ -0,0 +1,221 @@
+#ifndef THREADPOOL_HPP_
+#define THREADPOOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "stats.hpp"
+
+// Fixed size pool of worker threads
+// Tasks run in submission order; their results and exceptions are
+// delivered through the returned std::future.
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stopping{false};
+
+	void run() {
+		SREC_STATS_THREAD("pool");
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) {
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+public:
+	// threads == 0 uses all hardware threads
+	explicit ThreadPool(unsigned int threads = 0) {
+		if (threads == 0) {
+			threads = default_threads();
+		}
+		for (unsigned int i = 0; i < threads; ++i) {
+			workers.emplace_back([this] { run(); });
+		}
+	}
+
+	// Waits for all queued tasks to finish
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	template <class F>
+	auto submit(F &&f) -> std::future<decltype(f())> {
+		auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+		auto result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.emplace_back([task] { (*task)(); });
+		}
+		cv.notify_one();
+		return result;
+	}
+
+	size_t size() const {
+		return workers.size();
+	}
+
+	static unsigned int default_threads() {
+		unsigned int threads = std::thread::hardware_concurrency();
+		return threads > 0 ? threads : 1;
+	}
+};
+
+// Pool of worker threads with a task queue per worker
+// Tasks submitted by a worker go to its own queue, other tasks are spread
+// over the queues round-robin. A worker runs its newest task first and,
+// once its queue is empty, steals the oldest task of another worker, so
+// tasks of very different length (like files of very different size)
+// keep every thread busy. Tasks run in no particular order.
+class WorkStealingPool {
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::mutex mutex; // guards sleeping and 'pending' changes that wake workers
+	std::condition_variable cv;
+	std::atomic<size_t> pending{0}; // queued tasks
+	std::atomic<size_t> next{0};    // queue of the next task from outside
+	bool stopping{false};
+
+	// Worker index of the calling thread in this pool, or size() if it is not one
+	size_t self() const {
+		return current().first == this ? current().second : queues.size();
+	}
+
+	static std::pair<const WorkStealingPool *, size_t> &current() {
+		static thread_local std::pair<const WorkStealingPool *, size_t> worker{nullptr, 0};
+		return worker;
+	}
+
+	bool take(size_t index, std::function<void()> &task) {
+		// own queue from the back
+		{
+			Queue &queue = *queues[index];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+				return true;
+			}
+		}
+		// the others from the front
+		for (size_t i = 1; i < queues.size(); ++i) {
+			Queue &queue = *queues[(index + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run(size_t index) {
+		SREC_STATS_THREAD("pool");
+		current() = {this, index};
+		for (;;) {
+			std::function<void()> task;
+			if (take(index, task)) {
+				pending--;
+				task();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return stopping || pending > 0; });
+			if (stopping && pending == 0) {
+				return;
+			}
+		}
+	}
+
+public:
+	// threads == 0 uses all hardware threads
+	explicit WorkStealingPool(unsigned int threads = 0) {
+		if (threads == 0) {
+			threads = ThreadPool::default_threads();
+		}
+		for (unsigned int i = 0; i < threads; ++i) {
+			queues.push_back(std::make_unique<Queue>());
+		}
+		for (unsigned int i = 0; i < threads; ++i) {
+			workers.emplace_back([this, i] { run(i); });
+		}
+	}
+
+	// Waits for all queued tasks to finish
+	~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	WorkStealingPool(const WorkStealingPool &) = delete;
+	WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+	template <class F>
+	auto submit(F &&f) -> std::future<decltype(f())> {
+		auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+		auto result = task->get_future();
+		size_t index = self();
+		if (index == queues.size()) {
+			index = next++ % queues.size();
+		}
+		// Counted before it is queued, so a worker that takes the task at
+		// once cannot bring 'pending' below zero
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending++;
+		}
+		{
+			Queue &queue = *queues[index];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.emplace_back([task] { (*task)(); });
+		}
+		cv.notify_one();
+		return result;
+	}
+
+	size_t size() const {
+		return workers.size();
+	}
+};
+
+#endif /* THREADPOOL_HPP_ */
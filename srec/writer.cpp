@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.hpp"
+#include "stats.hpp"
+#include "threadpool.hpp"
+#include "writer.hpp"
+
+namespace {
+
+// Input bytes encoded by one task
+constexpr size_t TASK_SIZE = 4 * 1024 * 1024;
+
+template <class Encoder>
+char *put_line(char *out, unsigned int address, const uint8_t *data, size_t length) {
+	const size_t n = Encoder::encode(address, data, length, out);
+	out[n] = '\n';
+	return out + n + 1;
+}
+
+// Encode data as records of 'record_size' bytes, returns the end of the text
+template <class Encoder>
+char *put_records(char *out, unsigned int address, const uint8_t *data, size_t length, size_t record_size) {
+	for (size_t offset = 0; offset < length; offset += record_size) {
+		out = put_line<Encoder>(out, address + static_cast<unsigned int>(offset), data + offset,
+		                        std::min(record_size, length - offset));
+	}
+	return out;
+}
+
+// Unmaps and closes the output on every path
+struct Output {
+	int fd{-1};
+	char *map{nullptr};
+	size_t size{0};
+
+	~Output() {
+		if (map != nullptr) {
+			::munmap(map, size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+};
+
+template <class DataEncoder, class TermEncoder>
+unsigned int write_layout(const std::string &filename, SrecFile::AddressSize address_size,
+                          const uint8_t *data, size_t length, const ParallelWriteOptions &options) {
+	const size_t record_size = SrecFile::max_data_bytes_per_record(address_size);
+	const size_t records = (length + record_size - 1) / record_size;
+	if (records > 0xFFFFFF) {
+		throw std::out_of_range("Record count must be less than 0xFFFFFF");
+	}
+
+	// Every line's length follows from the record sizes
+	const size_t header_line = options.checksum ? S0Encoder::line_length(5) + 1 : 0;
+	const size_t data_line = DataEncoder::line_length(record_size) + 1;
+	const size_t last_size = length - (records > 0 ? (records - 1) * record_size : 0);
+	const size_t data_size = records > 0 ? (records - 1) * data_line + DataEncoder::line_length(last_size) + 1 : 0;
+	const size_t count_line = (records <= 0xFFFF ? S5Encoder::line_length(0) : S6Encoder::line_length(0)) + 1;
+	const size_t term_line = TermEncoder::line_length(0) + 1;
+
+	Output out;
+	out.size = header_line + data_size + count_line + term_line;
+	out.fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out.fd < 0) {
+		throw std::ios_base::failure("Failed to open output file: " + filename);
+	}
+	struct stat st{};
+	if (::fstat(out.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		throw std::ios_base::failure("Not a regular file: " + filename);
+	}
+	if (::ftruncate(out.fd, static_cast<off_t>(out.size)) != 0) {
+		throw std::ios_base::failure("Failed to set size of file: " + filename);
+	}
+	// Allocating the blocks up front saves the page faults from doing it one
+	// page at a time; not every file system supports it. Running out of space
+	// has to be caught here, stores to the mapping would raise SIGBUS.
+	const int alloc = ::posix_fallocate(out.fd, 0, static_cast<off_t>(out.size));
+	if (alloc != 0 && alloc != EOPNOTSUPP && alloc != EINVAL) {
+		throw std::ios_base::failure("Failed to allocate file: " + filename + ": " + std::strerror(alloc));
+	}
+	void *addr = ::mmap(nullptr, out.size, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+	SREC_STATS_ADD(Syscalls, 1);
+	SREC_STATS_ADD(BytesOut, out.size);
+	if (addr == MAP_FAILED) {
+		throw std::ios_base::failure("Failed to map file: " + filename);
+	}
+	out.map = static_cast<char *>(addr);
+	char *records_begin = out.map + header_line;
+
+	// Encode records [first, last) in place, returns the CRC of their data
+	auto encode = [=](size_t first, size_t last) {
+		const size_t begin = first * record_size;
+		const size_t end = std::min(last * record_size, length);
+		{
+			SREC_STATS_TIME_BYTES(Encode, end - begin);
+			put_records<DataEncoder>(records_begin + first * data_line, static_cast<unsigned int>(begin),
+			                         data + begin, end - begin, record_size);
+		}
+		SREC_STATS_ADD(Records, last - first);
+		SREC_STATS_TIME_BYTES(Crc, end - begin);
+		return xcrc32(data + begin, end - begin, 0);
+	};
+
+	const size_t task_records = std::max<size_t>(1, TASK_SIZE / record_size);
+	unsigned int crc = 0;
+	const unsigned int threads = options.threads != 0 ? options.threads : ThreadPool::default_threads();
+	if (threads == 1 || records <= task_records) {
+		crc = encode(0, records);
+	} else {
+		ThreadPool pool(threads);
+		std::deque<std::future<unsigned int>> pending;
+		for (size_t first = 0; first < records; first += task_records) {
+			const size_t last = std::min(first + task_records, records);
+			pending.push_back(pool.submit([=] { return encode(first, last); }));
+		}
+		// Combine the CRCs of the ranges in file order
+		for (size_t first = 0; first < records; first += task_records) {
+			const size_t end = std::min((first + task_records) * record_size, length);
+			crc = crc32_combine(crc, pending.front().get(), end - first * record_size);
+			pending.pop_front();
+		}
+	}
+
+	if (options.checksum) {
+		const auto header = crc_header(crc);
+		put_line<S0Encoder>(out.map, 0, header.data(), header.size());
+	}
+	char *tail = records_begin + data_size;
+	if (records <= 0xFFFF) {
+		tail = put_line<S5Encoder>(tail, static_cast<unsigned int>(records), nullptr, 0);
+	} else {
+		tail = put_line<S6Encoder>(tail, static_cast<unsigned int>(records), nullptr, 0);
+	}
+	put_line<TermEncoder>(tail, 0, nullptr, 0);
+
+	if (options.sync) {
+		SREC_STATS_TIME(Sync);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (::msync(out.map, out.size, MS_SYNC) != 0) {
+			throw std::ios_base::failure("Failed to sync file: " + filename);
+		}
+	}
+	::munmap(out.map, out.size);
+	out.map = nullptr;
+	if (options.sync) {
+		SREC_STATS_TIME(Sync);
+		SREC_STATS_ADD(Syscalls, 1);
+		if (::fsync(out.fd) != 0) {
+			throw std::ios_base::failure("Failed to sync file: " + filename);
+		}
+	}
+	const int fd = out.fd;
+	out.fd = -1;
+	if (::close(fd) != 0) {
+		throw std::ios_base::failure("Failed to close file: " + filename);
+	}
+	return crc;
+}
+
+} // namespace
+
+size_t encoded_image_size(SrecFile::AddressSize address_size, size_t length) {
+	const size_t record_size = SrecFile::max_data_bytes_per_record(address_size);
+	const size_t records = (length + record_size - 1) / record_size;
+	// every record has the type, count, address and checksum around its data
+	const size_t address_bytes = 2 + static_cast<size_t>(address_size);
+	const size_t overhead = 4 + 2 * (address_bytes + 1) + 1;
+	return records * overhead + 2 * length;
+}
+
+size_t encode_image(SrecFile::AddressSize address_size, const uint8_t *data, size_t length,
+                    unsigned int address, char *out) {
+	const size_t record_size = SrecFile::max_data_bytes_per_record(address_size);
+	switch (address_size) {
+		case SrecFile::AddressSize::BITS16:
+			put_records<S1Encoder>(out, address, data, length, record_size);
+			break;
+		case SrecFile::AddressSize::BITS24:
+			put_records<S2Encoder>(out, address, data, length, record_size);
+			break;
+		case SrecFile::AddressSize::BITS32:
+			put_records<S3Encoder>(out, address, data, length, record_size);
+			break;
+	}
+	return (length + record_size - 1) / record_size;
+}
+
+unsigned int write_srec_parallel(const std::string &filename, SrecFile::AddressSize address_size,
+                                 const uint8_t *data, size_t length, const ParallelWriteOptions &options) {
+	switch (address_size) {
+		case SrecFile::AddressSize::BITS16:
+			return write_layout<S1Encoder, S9Encoder>(filename, address_size, data, length, options);
+		case SrecFile::AddressSize::BITS24:
+			return write_layout<S2Encoder, S8Encoder>(filename, address_size, data, length, options);
+		case SrecFile::AddressSize::BITS32:
+			return write_layout<S3Encoder, S7Encoder>(filename, address_size, data, length, options);
+	}
+	throw std::invalid_argument("Invalid address size");
+}
@@ -0,0 +1,38 @@
+#ifndef WRITER_HPP_
+#define WRITER_HPP_
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "srec.hpp"
+
+// Characters encode_image() writes for 'length' bytes of data
+size_t encoded_image_size(SrecFile::AddressSize address_size, size_t length);
+
+// Encode data as records of max_data_bytes_per_record() bytes from 'address'
+// Every record is followed by a newline, 'out' must have room for
+// encoded_image_size() characters. Returns the number of records.
+size_t encode_image(SrecFile::AddressSize address_size, const uint8_t *data, size_t length,
+                    unsigned int address, char *out);
+
+// Options of write_srec_parallel()
+struct ParallelWriteOptions {
+	bool checksum{false};   // reserve an S0 record with the CRC32 of the data
+	bool sync{false};       // fsync the file before returning
+	unsigned int threads{0}; // 0 uses all hardware threads
+};
+
+// Write a flat binary as an S-record file on a pool of threads
+// The output is the same as SrecFile writing an optional CRC header, the
+// data with write_image() from address 0, the record count and the
+// termination record. All data records but the last have the same size,
+// so the length and offset of every line are known up front: the file is
+// sized with ftruncate(), mapped, and disjoint ranges of records are
+// encoded straight into place. The output must be a regular file.
+// Returns the xcrc32 of the data.
+unsigned int write_srec_parallel(const std::string &filename, SrecFile::AddressSize address_size,
+                                 const uint8_t *data, size_t length,
+                                 const ParallelWriteOptions &options = ParallelWriteOptions());
+
+#endif /* WRITER_HPP_ */
@@ -2,59 +2,35 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <optional>
 
 #include "argparse.hpp"
 #include "srec/srec.hpp"
+#include "srec/reader.hpp"
+#include "srec/image.hpp"
+#include "srec/mapped.hpp"
+#include "srec/stats.hpp"
 
-void convert_srec_to_bin(const std::string &input_file, const std::string &output_file) {
-	std::ifstream input(input_file);
-	std::ofstream output(output_file, std::ios::binary);
-
-	if (!input.is_open()) {
-		std::cerr << "Failed to open input file: " << input_file << std::endl;
-		throw std::ios_base::failure("Failed to open input file");
+// Place each record's data at its address relative to 'base'
+// (the lowest address when not given) and write it as a flat binary.
+// Gaps are filled with 'fill', or left as holes when it is negative.
+void convert_srec_to_bin(const std::string &input_file, const std::string &output_file, unsigned int jobs,
+                         std::optional<unsigned int> base, int fill) {
+	// Pipes are converted record by record in constant memory,
+	// which needs the records in address order
+	if (input_file == "-" || !MappedFile::mappable(input_file)) {
+		SrecStream stream(input_file);
+		stream_binary(stream, output_file, base, fill, jobs);
+		return;
 	}
 
-	if (!output.is_open()) {
-		std::cerr << "Failed to open output file: " << output_file << std::endl;
-		throw std::ios_base::failure("Failed to open output file");
-	}
+	SrecReader reader(input_file);
 
-	std::string line;
-	while (std::getline(input, line)) {
-		if (line.empty()) {
-			continue;
-		}
-
-		if (line[0] != 'S') {
-			continue;
-		}
-		if (line[1] != '1' && line[1] != '2' && line[1] != '3') {
-			continue;
-		}
-		std::string data;
-		if (line[1] == '1') {
-			data = line.substr(4+(Srec1::ADDRESS_SIZE*2)); // cut off S#, byte_count, and address
-			data = data.substr(0, data.size() - 2); // cut off checksum
-		} else if (line[1] == '2') {
-			data = line.substr(4+(Srec2::ADDRESS_SIZE*2)); // cut off S#, byte_count, and address
-			data = data.substr(0, data.size() - 2); // cut off checksum
-		} else if (line[1] == '3') {
-			data = line.substr(4+(Srec3::ADDRESS_SIZE*2));	// cut off S#, byte_count, and address
-			data = data.substr(0, data.size() - 2); // cut off checksum
-		}
-		// walk through the data string and covert each ASCII pair to a byte
-		// and write it to the output file
-		// e.g. "010203" -> 0x01, 0x02, 0x03
-		for (size_t i = 0; i < data.size(); i += 2) {
-			auto byte = static_cast<uint8_t>(std::stoi(data.substr(i, 2), nullptr, 16));
-			output.write(reinterpret_cast<const char *>(&byte), 1);
-		}
-		output.flush();
-	}
+	// Records are decoded on 'jobs' threads and placed in address order
+	SrecImage image;
+	image.load(reader, SrecImage::Overlap::Error, jobs);
 
-	input.close();
-	output.close();
+	image.write_binary(output_file, base.value_or(image.min_address()), fill);
 }
 
 int main(int argc, char *argv[]) {
@@ -62,9 +38,36 @@ int main(int argc, char *argv[]) {
 	// Define arguments
 	argparse::ArgumentParser program("srec2bin");
 	program.add_argument("-i", "--input")
-		.help("Input file in SREC format");
+		.help("Input file in SREC format, - for stdin");
 	program.add_argument("-o", "--output")
-		.help("Output file in binary format");
+		.help("Output file in binary format, - for stdout");
+	program.add_argument("-j", "--jobs")
+		.help("Number of threads used to decode the input, 0 uses all cores")
+		.default_value(0)
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("-f", "--fill")
+		.help("Fill gaps between records with this byte, e.g. 0xFF, instead of leaving holes")
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("-a", "--base")
+		.help("Address of the first output byte, defaults to the lowest record address")
+		.nargs(1)
+		.scan<'i', unsigned int>();
+	program.add_argument("--stats")
+		.help("Print the time of each phase and counters of the run to stderr")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--stats-json")
+		.help("Like --stats, as JSON")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--trace")
+		.help("Write a Chrome trace-event JSON file of the phases of every thread");
+	program.add_argument("--perf")
+		.help("Count CPU cycles, instructions, cache and branch misses of every phase, printed like --stats")
+		.default_value(false)
+		.implicit_value(true);
 
 	// Parse arguments
 	try {
@@ -76,6 +79,19 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	// Reported when main() returns, however the run ends
+	stats::Session stats_session;
+	if (program.get<bool>("--stats") || program.get<bool>("--stats-json")) {
+		stats_session.report(program.get<bool>("--stats-json") ? stats::Format::Json : stats::Format::Table);
+	}
+	if (auto trace = program.present("--trace")) {
+		stats_session.trace(*trace);
+	}
+	if (program.get<bool>("--perf")) {
+		stats_session.perf();
+	}
+	stats_session.start();
+
 	// Check if input file is specified
 	if (!program.present("-i")) {
 		std::cerr << "Input file is not specified" << std::endl;
@@ -93,7 +109,25 @@ int main(int argc, char *argv[]) {
 	std::string input_file = program.get<std::string>("-i");
 	std::string output_file = program.get<std::string>("-o");
 
-	convert_srec_to_bin(input_file, output_file);
+	int fill = program.present<int>("--fill").value_or(-1);
+	if (program.is_used("--fill") && (fill < 0 || fill > 0xFF)) {
+		std::cerr << "Fill value must be a byte" << std::endl;
+		return 1;
+	}
+
+	const int jobs = program.get<int>("--jobs");
+	if (jobs < 0) {
+		std::cerr << "Invalid number of jobs" << std::endl;
+		return 1;
+	}
+
+	try {
+		convert_srec_to_bin(input_file, output_file, jobs,
+		                    program.present<unsigned int>("--base"), fill);
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
 	return 0;
 }
 
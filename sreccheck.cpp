@@ -2,17 +2,272 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+#include <cctype>
 #include <cstdint>
 
 #include "argparse.hpp"
+#include "srec/aio.hpp"
 #include "srec/crc32.hpp"
+#include "srec/mapped.hpp"
+#include "srec/reader.hpp"
+#include "srec/stats.hpp"
+#include "srec/threadpool.hpp"
+
+// Result of checking one file
+struct CheckResult {
+	unsigned long found_crc{0};
+	unsigned long calculated_crc{0};
+	std::string error; // why the file could not be checked, empty if it could
+
+	bool ok() const {
+		return error.empty() && found_crc == calculated_crc;
+	}
+};
+
+// Verify the record checksums and the CRC32 of the chunks 'parse' passes to its argument
+template <class Parse>
+CheckResult check(Parse &&parse) {
+	CheckResult result;
+
+	// read the CRC, the first 4 bytes of the header data
+	auto read_crc = [&result](const SrecRecord &record) {
+		try {
+			result.found_crc = std::stoul(std::string(record.payload.substr(0, 8)), nullptr, 16);
+		} catch (const std::exception &err) {
+			throw std::invalid_argument("Failed to parse CRC");
+		}
+	};
+
+	try {
+		// Chunks are decoded concurrently and arrive in file order,
+		// their CRCs are combined into the CRC of the whole image
+		parse([&read_crc, &result](const SrecChunk &chunk) {
+			for (const auto &record : chunk.others) {
+				if (record.type == Srec::Type::S0) {
+					read_crc(record);
+				}
+			}
+			result.calculated_crc = crc32_combine(result.calculated_crc, chunk.crc, chunk.data.size());
+		});
+	} catch (const std::exception &err) {
+		result.error = err.what();
+	}
+	return result;
+}
+
+// Check one file on 'jobs' threads
+CheckResult check_file(const std::string &filename, unsigned int jobs) {
+	return check([&](const std::function<void(const SrecChunk &)> &handler) {
+		if (filename == "-" || !MappedFile::mappable(filename)) {
+			// Pipes are read block by block in constant memory
+			SrecStream stream(filename);
+			stream.parse_parallel(handler, jobs);
+		} else {
+			SrecReader reader(filename);
+			reader.parse_parallel(handler, jobs);
+		}
+	});
+}
+
+// Check the contents of a file that was already read, on the calling thread
+CheckResult check_contents(const std::string &filename, std::vector<char> contents) {
+	return check([&](const std::function<void(const SrecChunk &)> &handler) {
+		SrecReader reader(filename, std::move(contents));
+		reader.parse_parallel(handler, 1);
+	});
+}
+
+// S-record files in a directory are recognized by their extension
+bool is_srec_name(const std::filesystem::path &path) {
+	std::string ext = path.extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+	for (const char *known : {".srec", ".s19", ".s28", ".s37", ".mot", ".s"}) {
+		if (ext == known) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Expand directories (recursively) and @filelists (one name per line)
+// Returns false if an argument cannot be expanded or names no files, so a
+// wrong path does not pass as an empty batch.
+bool expand_inputs(const std::vector<std::string> &args, std::vector<std::string> &files) {
+	namespace fs = std::filesystem;
+	for (const auto &arg : args) {
+		if (arg.size() > 1 && arg[0] == '@') {
+			std::ifstream list(arg.substr(1));
+			if (!list) {
+				std::cerr << "Failed to open file list: " << arg.substr(1) << std::endl;
+				return false;
+			}
+			std::string line;
+			size_t listed = 0;
+			while (std::getline(list, line)) {
+				if (!line.empty() && line.back() == '\r') {
+					line.pop_back();
+				}
+				if (!line.empty()) {
+					files.push_back(line);
+					listed++;
+				}
+			}
+			if (listed == 0) {
+				std::cerr << "No files in file list: " << arg.substr(1) << std::endl;
+				return false;
+			}
+			continue;
+		}
+
+		std::error_code ec;
+		if (arg != "-" && fs::is_directory(arg, ec)) {
+			std::vector<std::string> found;
+			for (fs::recursive_directory_iterator it(arg, ec), end; !ec && it != end; it.increment(ec)) {
+				if (it->is_regular_file(ec) && is_srec_name(it->path())) {
+					found.push_back(it->path().string());
+				}
+			}
+			if (ec) {
+				std::cerr << "Failed to read directory: " << arg << std::endl;
+				return false;
+			}
+			if (found.empty()) {
+				std::cerr << "No SREC files in directory: " << arg << std::endl;
+				return false;
+			}
+			std::sort(found.begin(), found.end());
+			files.insert(files.end(), found.begin(), found.end());
+			continue;
+		}
+		files.push_back(arg);
+	}
+	return true;
+}
+
+std::string hex_crc(unsigned long crc) {
+	std::ostringstream ss;
+	ss << "0x" << std::uppercase << std::hex << std::setw(8) << std::setfill('0') << crc;
+	return ss.str();
+}
+
+// Files up to this size are read in batches through the I/O queue,
+// larger ones are mapped by the task that checks them
+constexpr uintmax_t QUEUED_READ_MAX = 1024 * 1024;
+// Contents read ahead of their checks, bounds the memory of a batch
+constexpr size_t QUEUED_BYTES_MAX = 64 * 1024 * 1024;
+
+// Check many files, one per task, and print a table of the results
+int check_batch(const std::vector<std::string> &files, unsigned int jobs) {
+	// Start with the largest files so the long tasks do not come last
+	std::vector<std::pair<uintmax_t, size_t>> order;
+	std::vector<size_t> queued;
+	for (size_t i = 0; i < files.size(); ++i) {
+		std::error_code ec;
+		const uintmax_t size = files[i] == "-" ? 0 : std::filesystem::file_size(files[i], ec);
+		// file_size() only succeeds for regular files
+		if (files[i] != "-" && !ec && size <= QUEUED_READ_MAX) {
+			queued.push_back(i);
+		} else {
+			order.emplace_back(ec ? 0 : size, i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+	// Every file is checked on one thread, the results are printed in
+	// the order of the arguments as they become available
+	WorkStealingPool pool(jobs);
+	std::vector<std::future<CheckResult>> results(files.size());
+	for (const auto &entry : order) {
+		const std::string &filename = files[entry.second];
+		results[entry.second] = pool.submit([&filename] { return check_file(filename, 1); });
+	}
+
+	// Small files are read with many reads in flight, through io_uring where
+	// the kernel has it, and checked from memory while the next ones are read
+	std::vector<std::string> names;
+	for (size_t i : queued) {
+		names.push_back(files[i]);
+	}
+	std::deque<std::pair<size_t, size_t>> checking; // file index and bytes held
+	size_t held = 0;
+	read_files(names, [&](size_t index, std::vector<char> &data, std::exception_ptr error) {
+		const size_t i = queued[index];
+		if (error) {
+			std::promise<CheckResult> failed;
+			try {
+				std::rethrow_exception(error);
+			} catch (const std::exception &err) {
+				failed.set_value(CheckResult{0, 0, err.what()});
+			}
+			results[i] = failed.get_future();
+			return;
+		}
+
+		while (held > QUEUED_BYTES_MAX && !checking.empty()) {
+			results[checking.front().first].wait();
+			held -= checking.front().second;
+			checking.pop_front();
+		}
+		checking.emplace_back(i, data.size());
+		held += data.size();
+		results[i] = pool.submit([&filename = files[i], contents = std::move(data)]() mutable {
+			return check_contents(filename, std::move(contents));
+		});
+	});
+
+	size_t passed = 0;
+	std::cout << std::left << std::setw(10) << "RESULT" << std::setw(12) << "FOUND" << std::setw(12) << "CALCULATED"
+	          << "FILE" << std::endl;
+	for (size_t i = 0; i < files.size(); ++i) {
+		const CheckResult result = results[i].get();
+		if (!result.error.empty()) {
+			std::cout << std::setw(10) << "ERROR" << std::setw(12) << "-" << std::setw(12) << "-"
+			          << files[i] << ": " << result.error << std::endl;
+			continue;
+		}
+		std::cout << std::setw(10) << (result.ok() ? "OK" : "MISMATCH") << std::setw(12) << hex_crc(result.found_crc)
+		          << std::setw(12) << hex_crc(result.calculated_crc) << files[i] << std::endl;
+		if (result.ok()) {
+			passed++;
+		}
+	}
+	std::cout << files.size() << " files checked, " << passed << " passed, " << files.size() - passed << " failed"
+	          << std::endl;
+	return passed == files.size() ? 0 : 1;
+}
 
 int main(int argc, char *argv[]) {
 
 	// Define arguments
 	argparse::ArgumentParser program("sreccheck");
-	program.add_argument("file").help("SREC file to check");
+	program.add_argument("files")
+		.help("SREC files, directories or @filelists to check, - for stdin")
+		.nargs(argparse::nargs_pattern::at_least_one);
 	program.add_argument("-v", "--verbose").help("Verbose mode").default_value(false).implicit_value(true);
+	program.add_argument("-j", "--jobs").help("Number of threads, 0 uses all cores").default_value(0).nargs(1).scan<'i', int>();
+	program.add_argument("--stats")
+		.help("Print the time of each phase and counters of the run to stderr")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--stats-json")
+		.help("Like --stats, as JSON")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--trace")
+		.help("Write a Chrome trace-event JSON file of the phases of every thread");
+	program.add_argument("--perf")
+		.help("Count CPU cycles, instructions, cache and branch misses of every phase, printed like --stats")
+		.default_value(false)
+		.implicit_value(true);
 
 	// Parse arguments
 	try {
@@ -24,68 +279,55 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	// Reported when main() returns, however the run ends
+	stats::Session stats_session;
+	if (program.get<bool>("--stats") || program.get<bool>("--stats-json")) {
+		stats_session.report(program.get<bool>("--stats-json") ? stats::Format::Json : stats::Format::Table);
+	}
+	if (auto trace = program.present("--trace")) {
+		stats_session.trace(*trace);
+	}
+	if (program.get<bool>("--perf")) {
+		stats_session.perf();
+	}
+	stats_session.start();
+
 	// Check if file is specified
-	std::string srecfilename;
+	std::vector<std::string> args;
 	try {
-		srecfilename = program.get<std::string>("file");
+		args = program.get<std::vector<std::string>>("files");
 	} catch (const std::exception &err) {
 		std::cerr << "No file specified" << std::endl;
 		std::cerr << program;
 		return 1;
 	}
-
-	// Open file
-	std::ifstream srecfile(srecfilename);
-	if (!srecfile.is_open()) {
-		std::cerr << "Failed to open file" << std::endl;
+	const int jobs = program.get<int>("--jobs");
+	if (jobs < 0) {
+		std::cerr << "Invalid number of jobs" << std::endl;
 		return 1;
 	}
 
-	unsigned long found_crc = 0;
-	unsigned long sum = 0; // calculated CRC
-	std::string line;
-	std::vector<uint8_t> buff;
-
-	while (std::getline(srecfile, line)) {
-		if (line[0] == 'S') {
-			if (line[1] == '0') {
-				// read the CRC, bytes 8-15
-				try {
-					found_crc = std::stoul(line.substr(8, 8), nullptr, 16);
-				} catch (const std::out_of_range &err) {
-					std::cerr << "Failed to parse CRC" << std::endl;
-					return 1;
-				}
-				continue;
-			}
-
-			// determine the index to start at
-			unsigned int start = 2;
-			if (line[1] == '1') {
-				start = 4 /* S1 + byte count */ + 4 /* address */;
-			} else if (line[1] == '2') {
-				start = 4 /* S2 + byte count */ + 6 /* address */;
-			} else if (line[1] == '3') {
-				start = 4 /* S3 + byte count */ + 8 /* address */;
-			} else {
-				// not an S1/S2/S3 record, skip
-				continue;
-			}
+	// More than one file, a directory or a file list checks a batch of files
+	std::vector<std::string> files;
+	if (!expand_inputs(args, files)) {
+		return 1;
+	}
+	if (args.size() > 1 || files.size() != 1 || files[0] != args[0]) {
+		return check_batch(files, jobs);
+	}
 
-			buff.clear();
-			for (unsigned int i = start; i < line.size()-2/*skip checksum*/; i += 2) {
-				buff.push_back(static_cast<uint8_t>(std::stoul(line.substr(i, 2), nullptr, 16)));
-			}
-			sum = xcrc32(buff.data(), buff.size(), sum);
-		}
+	const CheckResult result = check_file(files[0], jobs);
+	if (!result.error.empty()) {
+		std::cerr << result.error << std::endl;
+		return 1;
 	}
 
 	// Print results, if verbose flag is set
 	if (program.get<bool>("verbose")) {
-		std::cout << "Found CRC:       0x" << std::uppercase << std::hex << found_crc << std::endl;
-		std::cout << "Calculated CRC:  0x" << std::uppercase << std::hex << sum << std::endl;
+		std::cout << "Found CRC:       0x" << std::uppercase << std::hex << result.found_crc << std::endl;
+		std::cout << "Calculated CRC:  0x" << std::uppercase << std::hex << result.calculated_crc << std::endl;
 	}
-	if (found_crc == sum) {
+	if (result.ok()) {
 		if (program.get<bool>("verbose")) {
 			std::cout << "CRC matches" << std::endl;
 		}
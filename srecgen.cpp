@@ -0,0 +1,373 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include "argparse.hpp"
+
+#include "srec/srec.hpp"
+#include "srec/crc32.hpp"
+
+// Records shuffled together with --shuffle
+constexpr size_t SHUFFLE_WINDOW = 1024;
+
+// A contiguous range of generated data
+struct Segment {
+	uint64_t base;
+	uint64_t size;
+};
+
+// splitmix64, small and fast; the same seed gives the same corpus everywhere
+class Random {
+	uint64_t state;
+
+public:
+	explicit Random(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	// Uniform in [0, n), n must not be zero
+	uint64_t below(uint64_t n) {
+		return next() % n;
+	}
+
+	void fill(uint8_t *out, size_t length) {
+		size_t i = 0;
+		for (; i + 8 <= length; i += 8) {
+			const uint64_t value = next();
+			std::memcpy(out + i, &value, 8);
+		}
+		if (i < length) {
+			const uint64_t value = next();
+			std::memcpy(out + i, &value, length - i);
+		}
+	}
+};
+
+// Parse a number with an optional K, M or G suffix, hex with 0x
+uint64_t parse_size(const std::string &text) {
+	size_t end = 0;
+	uint64_t value;
+	try {
+		value = std::stoull(text, &end, 0);
+	} catch (const std::exception &) {
+		throw std::invalid_argument("Invalid size: " + text);
+	}
+	const std::string suffix = text.substr(end);
+	if (suffix == "K" || suffix == "k") {
+		value <<= 10;
+	} else if (suffix == "M" || suffix == "m") {
+		value <<= 20;
+	} else if (suffix == "G" || suffix == "g") {
+		value <<= 30;
+	} else if (!suffix.empty()) {
+		throw std::invalid_argument("Invalid size: " + text);
+	}
+	return value;
+}
+
+// Parse "<base>:<size>[,<base>:<size>...]"
+std::vector<Segment> parse_layout(const std::string &spec) {
+	std::vector<Segment> segments;
+	size_t begin = 0;
+	while (begin <= spec.size()) {
+		size_t end = spec.find(',', begin);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		const std::string item = spec.substr(begin, end - begin);
+		const size_t colon = item.find(':');
+		if (colon == std::string::npos) {
+			throw std::invalid_argument("Invalid segment, expected <base>:<size>: " + item);
+		}
+		segments.push_back({parse_size(item.substr(0, colon)), parse_size(item.substr(colon + 1))});
+		begin = end + 1;
+	}
+	return segments;
+}
+
+// Spread 'count' segments of random size, 'size' bytes in total, over the address space
+std::vector<Segment> random_layout(Random &random, size_t count, uint64_t size, uint64_t space) {
+	if (count == 0) {
+		throw std::invalid_argument("Number of segments must not be zero");
+	}
+	std::vector<uint64_t> weights(count);
+	uint64_t total = 0;
+	for (auto &weight : weights) {
+		weight = 1 + random.below(1000);
+		total += weight;
+	}
+
+	// every segment gets its own slot of the address space, so they cannot overlap
+	const uint64_t slot = space / count;
+	std::vector<Segment> segments;
+	uint64_t left = size;
+	for (size_t i = 0; i < count; ++i) {
+		const uint64_t length = i + 1 == count ? left : size / total * weights[i] + size % total * weights[i] / total;
+		left -= length;
+		if (length > slot) {
+			throw std::invalid_argument("Segments do not fit the address space, use fewer or smaller ones");
+		}
+		const uint64_t offset = (slot == length ? 0 : random.below(slot - length + 1)) & ~uint64_t(15);
+		segments.push_back({slot * i + offset, length});
+	}
+	return segments;
+}
+
+struct Options {
+	SrecFile::AddressSize address_size{SrecFile::AddressSize::BITS32};
+	size_t min_record{0};
+	size_t max_record{0};
+	bool mixed{false};
+	bool shuffle{false};
+	bool checksum{false};
+};
+
+// A record of the current shuffle window
+struct PendingRecord {
+	uint32_t address;
+	size_t offset; // in the window's data
+	size_t length;
+};
+
+class Generator {
+	SrecFile &sfile;
+	const Options &options;
+	Random random;
+	unsigned int crc{0};
+	uint64_t count{0};
+	std::vector<uint8_t> window;
+	std::vector<PendingRecord> records;
+
+	SrecFile::AddressSize record_type(uint64_t end) {
+		if (!options.mixed) {
+			return options.address_size;
+		}
+		// any type that can hold the record's last address
+		const size_t choices = end <= 0x10000 ? 3 : end <= 0x1000000 ? 2 : 1;
+		return static_cast<SrecFile::AddressSize>(2 - random.below(choices));
+	}
+
+	void flush_window() {
+		if (options.shuffle) {
+			for (size_t i = records.size(); i > 1; --i) {
+				std::swap(records[i - 1], records[random.below(i)]);
+			}
+		}
+		for (const auto &record : records) {
+			const uint8_t *data = window.data() + record.offset;
+			sfile.write_record(record_type(uint64_t(record.address) + record.length), record.address, data, record.length);
+			if (options.checksum) {
+				crc = xcrc32(data, record.length, crc);
+			}
+		}
+		count += records.size();
+		records.clear();
+	}
+
+public:
+	Generator(SrecFile &sfile, const Options &options, uint64_t seed)
+		: sfile(sfile), options(options), random(seed), window(SHUFFLE_WINDOW * options.max_record) {}
+
+	void segment(const Segment &segment) {
+		size_t used = 0;
+		for (uint64_t offset = 0; offset < segment.size;) {
+			size_t length = options.min_record;
+			if (options.max_record > options.min_record) {
+				length += random.below(options.max_record - options.min_record + 1);
+			}
+			length = static_cast<size_t>(std::min<uint64_t>(length, segment.size - offset));
+
+			random.fill(window.data() + used, length);
+			records.push_back({static_cast<uint32_t>(segment.base + offset), used, length});
+			used += length;
+			offset += length;
+			if (records.size() == SHUFFLE_WINDOW) {
+				flush_window();
+				used = 0;
+			}
+		}
+		flush_window();
+	}
+
+	unsigned int checksum() const {
+		return crc;
+	}
+
+	uint64_t records_written() const {
+		return count;
+	}
+};
+
+int main(int argc, char *argv[]) {
+	argparse::ArgumentParser program("srecgen");
+	program.add_argument("-o", "--output")
+		.help("Output file, - for stdout")
+		.default_value(std::string("-"));
+	program.add_argument("--seed")
+		.help("Seed of the generated data and layout")
+		.default_value(std::string("1"));
+	program.add_argument("-b", "--addrbits")
+		.help("Address bits, 16, 24, or 32")
+		.default_value(32)
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("-l", "--layout")
+		.help("Segments as <base>:<size>[,<base>:<size>...], e.g. 0x08000000:1M,0x20000000:64K")
+		.default_value(std::string());
+	program.add_argument("--size")
+		.help("Total data size of a random layout, with K, M or G suffix, less by default if 1M does not fit")
+		.default_value(std::string("1M"));
+	program.add_argument("--segments")
+		.help("Number of segments of a random layout, 1 starts at address 0")
+		.default_value(1)
+		.nargs(1)
+		.scan<'i', int>();
+	program.add_argument("-r", "--record-size")
+		.help("Data bytes per record as <n> or <min>:<max>, default the maximum")
+		.default_value(std::string());
+	program.add_argument("--mixed")
+		.help("Mix S1, S2 and S3 records where the address allows it")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--shuffle")
+		.help("Write segments and records out of address order")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--crlf")
+		.help("End lines with CR LF")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("-c", "--checksum")
+		.help("Add a CRC32 checksum S0 record like bin2srec")
+		.default_value(false)
+		.implicit_value(true);
+
+	try {
+		program.parse_args(argc, argv);
+	} catch (const std::exception &err) {
+		std::cerr << "Parsing command line arguments failed" << std::endl;
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	Options options;
+	uint64_t seed;
+	std::vector<Segment> segments;
+	try {
+		seed = std::stoull(program.get<std::string>("--seed"), nullptr, 0);
+
+		uint64_t space;
+		switch (program.get<int>("--addrbits")) {
+			case 16:
+				options.address_size = SrecFile::AddressSize::BITS16;
+				space = uint64_t(1) << 16;
+				break;
+			case 24:
+				options.address_size = SrecFile::AddressSize::BITS24;
+				space = uint64_t(1) << 24;
+				break;
+			case 32:
+				options.address_size = SrecFile::AddressSize::BITS32;
+				space = uint64_t(1) << 32;
+				break;
+			default:
+				throw std::invalid_argument("Invalid address size");
+		}
+
+		options.mixed = program.get<bool>("--mixed");
+		options.shuffle = program.get<bool>("--shuffle");
+		options.checksum = program.get<bool>("--checksum");
+
+		// Mixed files can have S3 records anywhere, so every record must fit one
+		const size_t limit = SrecFile::max_data_bytes_per_record(
+			options.mixed ? SrecFile::AddressSize::BITS32 : options.address_size);
+		options.min_record = options.max_record = limit;
+		const std::string record_size = program.get<std::string>("--record-size");
+		if (!record_size.empty()) {
+			const size_t colon = record_size.find(':');
+			options.min_record = parse_size(record_size.substr(0, colon));
+			options.max_record = colon == std::string::npos ? options.min_record : parse_size(record_size.substr(colon + 1));
+		}
+		if (options.min_record == 0 || options.min_record > options.max_record || options.max_record > limit) {
+			throw std::invalid_argument("Invalid record size");
+		}
+
+		Random layout_random(seed);
+		const std::string layout = program.get<std::string>("--layout");
+		if (!layout.empty()) {
+			segments = parse_layout(layout);
+		} else {
+			const int count = program.get<int>("--segments");
+			if (count <= 0) {
+				throw std::invalid_argument("Number of segments must not be zero");
+			}
+			uint64_t size = parse_size(program.get<std::string>("--size"));
+			// The default must fit small address spaces, e.g. -b 16, with
+			// room for every segment of a random layout
+			if (!program.is_used("--size")) {
+				size = std::min(size, count == 1 ? space : space / 2 / static_cast<uint64_t>(count));
+			}
+			segments = count == 1 ? std::vector<Segment>{{0, size}} : random_layout(layout_random, count, size, space);
+		}
+		for (const auto &segment : segments) {
+			if (segment.base + segment.size > space) {
+				throw std::invalid_argument("Segment does not fit the address size");
+			}
+		}
+		if (options.shuffle) {
+			for (size_t i = segments.size(); i > 1; --i) {
+				std::swap(segments[i - 1], segments[layout_random.below(i)]);
+			}
+		}
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
+
+	SrecFile sfile(program.get<std::string>("--output"), options.address_size);
+	if (!sfile.is_open()) {
+		std::cerr << "Error opening output file" << std::endl;
+		return 1;
+	}
+	sfile.set_crlf(program.get<bool>("--crlf"));
+
+	try {
+		const bool crc_header = options.checksum && sfile.seekable();
+		if (crc_header) {
+			sfile.reserve_crc_header();
+		}
+
+		// The data of every run depends only on the seed
+		Generator generator(sfile, options, seed ^ 0x5DEECE66DULL);
+		for (const auto &segment : segments) {
+			generator.segment(segment);
+		}
+
+		if (options.checksum && !crc_header) {
+			sfile.write_crc_record(generator.checksum());
+		}
+		// S5/S6 cannot count more records, the count is optional
+		if (generator.records_written() <= 0xFFFFFF) {
+			sfile.write_record_count();
+		}
+		sfile.write_record_termination();
+		if (crc_header) {
+			sfile.write_crc_header(generator.checksum());
+		}
+		sfile.close();
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -5,8 +5,38 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <new>
+#include <numeric>
+#include <random>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
 
 #include "srec/srec.hpp"
+#include "srec/aio.hpp"
+#include "srec/reader.hpp"
+#include "srec/hex.hpp"
+#include "srec/crc32.hpp"
+#include "srec/image.hpp"
+#include "srec/index.hpp"
+#include "srec/perf.hpp"
+#include "srec/pipeline.hpp"
+#include "srec/stats.hpp"
+#include "srec/stats_alloc.hpp"
+#include "srec/threadpool.hpp"
+#include "srec/writer.hpp"
 
 // Test the ASCIIToHexString function
 TEST_CASE( "ASCIIToHexString", "[ASCIIToHexString]" ) {
@@ -39,3 +69,1112 @@ TEST_CASE( "SrecFile", "[SrecFile]") {
 	REQUIRE(line1 == "S30D000000007F454C460101010396");
 	f.close();
 }
+
+TEST_CASE( "SrecFile::write_image", "[SrecFile]") {
+	std::vector<uint8_t> image(1000);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = static_cast<uint8_t>(i * 3);
+	}
+
+	SrecFile sf("test_write_image.srec", SrecFile::AddressSize::BITS24);
+	const uint8_t header[] = {'H', 'D', 'R'};
+	sf.write_record_payload(header, sizeof(header));
+	sf.write_image(ByteSpan(image).subspan(100, 1000), 0x10000);
+	sf.write_record_payload(ByteSpan(header));
+	sf.close();
+
+	SrecReader reader("test_write_image.srec");
+	SrecRecord record;
+	std::vector<uint8_t> data(SrecRecord::MAX_DATA_SIZE);
+	REQUIRE(reader.next(record));
+	REQUIRE(record.address == 0);
+	REQUIRE(record.payload == "484452");
+
+	// full records followed by a short one
+	unsigned int address = 0x10000;
+	while (address < 0x10000 + 900) {
+		const size_t size = std::min<size_t>(sf.max_data_bytes_per_record(), 0x10000 + 900 - address);
+		REQUIRE(reader.next(record));
+		REQUIRE(record.type == Srec::Type::S2);
+		REQUIRE(record.address == address);
+		REQUIRE(record.size() == size);
+		record.decode(data.data());
+		REQUIRE(std::equal(data.begin(), data.begin() + size, image.begin() + 100 + (address - 0x10000)));
+		address += size;
+	}
+
+	// writing continues after the image
+	REQUIRE(reader.next(record));
+	REQUIRE(record.address == 0x10000 + 900);
+	REQUIRE_FALSE(reader.next(record));
+}
+
+TEST_CASE( "SrecReader", "[SrecReader]") {
+	{
+		std::ofstream f("test_reader.srec", std::ios::binary);
+		f << "S00600004844521B\r\n"
+		  << "\n"
+		  << "S1130000285F245F2212226A000424290008237C2A\n"
+		  << "S30D000000007F454C460101010396\n"
+		  << "S5030002FA\n"
+		  << "S9030000FC";
+	}
+	SrecReader reader("test_reader.srec");
+	SrecRecord record;
+
+	REQUIRE(reader.next(record));
+	REQUIRE(record.type == Srec::Type::S0);
+	REQUIRE(record.payload == "484452");
+	REQUIRE(record.line_number == 1);
+
+	REQUIRE(reader.next(record));
+	REQUIRE(record.type == Srec::Type::S1);
+	REQUIRE(record.address == 0x0000);
+	REQUIRE(record.size() == 16);
+	REQUIRE(record.line_number == 3);
+
+	REQUIRE(reader.next(record));
+	REQUIRE(record.type == Srec::Type::S3);
+	REQUIRE(record.payload == "7F454C4601010103");
+
+	REQUIRE(reader.next(record));
+	REQUIRE(record.type == Srec::Type::S5);
+	REQUIRE(record.address == 2);
+
+	REQUIRE(reader.next(record));
+	REQUIRE(record.type == Srec::Type::S9);
+	REQUIRE_FALSE(reader.next(record));
+
+	// byte count does not match the line length
+	REQUIRE_THROWS_AS(SrecReader::parse("S30E000000007F454C460101010396", 1, record), std::invalid_argument);
+	// S4 is reserved
+	REQUIRE_THROWS_AS(SrecReader::parse("S4030000FC", 1, record), std::invalid_argument);
+
+	// checksums are verified while decoding
+	uint8_t data[SrecRecord::MAX_DATA_SIZE];
+	SrecReader::parse("S30D000000007F454C460101010396", 1, record);
+	record.decode(data);
+	SrecReader::parse("S30D000000007F454C460101010397", 5, record);
+	try {
+		record.decode(data);
+		FAIL("no error reported");
+	} catch (const SrecChecksumError &err) {
+		REQUIRE(err.line_number() == 5);
+		REQUIRE(err.expected() == 0x97);
+		REQUIRE(err.actual() == 0x96);
+	}
+	SrecReader::parse("S5030002FB", 1, record);
+	REQUIRE_THROWS_AS(record.verify(), SrecChecksumError);
+	SrecReader::parse("S5030002FX", 1, record);
+	REQUIRE_THROWS_AS(record.verify(), SrecError);
+}
+
+TEST_CASE( "hex_decode", "[hex]") {
+	const HexKernel kernels[] = {HexKernel::Scalar, HexKernel::SSE2, HexKernel::AVX2, HexKernel::NEON};
+
+	std::string bytes;
+	for (int i = 0; i < 200; ++i) {
+		bytes.push_back(static_cast<char>(i * 37 + 11));
+	}
+	const std::string hex = ASCIIToHexString(bytes);
+	const std::vector<uint8_t> expected(bytes.begin(), bytes.end());
+	std::string lower = hex;
+	for (auto &c : lower) {
+		c = static_cast<char>(std::tolower(c));
+	}
+
+	for (const auto kernel : kernels) {
+		for (size_t len = 0; len <= bytes.size(); ++len) {
+			std::vector<uint8_t> out(len);
+			REQUIRE(hex_decode(std::string_view(hex).substr(0, 2 * len), out.data(), kernel) == std::string_view::npos);
+			REQUIRE(std::equal(out.begin(), out.end(), expected.begin()));
+			unsigned int sum = 1;
+			REQUIRE(hex_decode(std::string_view(lower).substr(0, 2 * len), out.data(), sum, kernel) == std::string_view::npos);
+			REQUIRE(std::equal(out.begin(), out.end(), expected.begin()));
+			REQUIRE(sum == std::accumulate(out.begin(), out.end(), 1u));
+		}
+
+		// every invalid character is reported at its position
+		std::vector<uint8_t> out(bytes.size());
+		for (const char bad : {'G', 'g', '/', ':', '@', '`', ' ', '\xC1'}) {
+			for (size_t pos : {0, 1, 31, 32, 63, 64, 100, 399}) {
+				std::string broken = hex;
+				broken[pos] = bad;
+				REQUIRE(hex_decode(broken, out.data(), kernel) == pos);
+			}
+		}
+		REQUIRE(hex_decode("ABC", out.data(), kernel) == 2);
+	}
+}
+
+TEST_CASE( "hex_encode", "[hex]") {
+	const HexKernel kernels[] = {HexKernel::Scalar, HexKernel::SSE2, HexKernel::AVX2, HexKernel::NEON};
+
+	std::vector<uint8_t> bytes;
+	for (int i = 0; i < 200; ++i) {
+		bytes.push_back(static_cast<uint8_t>(i * 37 + 11));
+	}
+
+	for (const auto kernel : kernels) {
+		for (size_t len = 0; len <= bytes.size(); ++len) {
+			std::string out(2 * len, '\0');
+			unsigned int sum = hex_encode(bytes.data(), len, out.data(), kernel);
+			REQUIRE(out == ASCIIToHexString(std::string(bytes.begin(), bytes.begin() + len)));
+			unsigned int expected_sum = 0;
+			for (size_t i = 0; i < len; ++i) {
+				expected_sum += bytes[i];
+			}
+			REQUIRE(sum == expected_sum);
+		}
+	}
+}
+
+TEST_CASE( "Srec::toString", "[Srec]") {
+	const std::vector<uint8_t> data = {0x28, 0x5F, 0x24, 0x5F, 0x22, 0x12, 0x22, 0x6A, 0x00, 0x04, 0x24, 0x29, 0x00, 0x08, 0x23, 0x7C};
+	REQUIRE(Srec1(0x0000, data).toString() == "S1130000285F245F2212226A000424290008237C2A");
+	REQUIRE(Srec0(std::string("HDR")).toString() == "S00600004844521B");
+	REQUIRE(Srec5(3).toString() == "S5030003F9");
+	REQUIRE(Srec9(0).toString() == "S9030000FC");
+	REQUIRE_THROWS_AS(Srec3(0, std::vector<uint8_t>(251)).toString(), std::invalid_argument);
+}
+
+TEST_CASE( "RecordEncoder", "[Srec]") {
+	static_assert(S1Encoder::line_length(16) == 42);
+	static_assert(S3Encoder::MAX_DATA_SIZE == 250);
+	static_assert(S3Encoder::MAX_LINE == MAX_LINE_LENGTH);
+	static_assert(S9Encoder::TYPE_CHAR == '9');
+
+	std::vector<uint8_t> data(250);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 13);
+	}
+	// same output as the generic encoder fed with the address in front of the data
+	char line[MAX_LINE_LENGTH];
+	char expected[MAX_LINE_LENGTH];
+	for (size_t len : {0, 1, 16, 33, 250}) {
+		std::vector<uint8_t> record = {0x12, 0x34, 0x56, 0x78};
+		record.insert(record.end(), data.begin(), data.begin() + len);
+		const size_t n = S3Encoder::encode(0x12345678, data.data(), len, line);
+		REQUIRE(n == S3Encoder::line_length(len));
+		REQUIRE(std::string(line, n) == std::string(expected, encode_record('3', record.data(), record.size(), expected)));
+	}
+	REQUIRE(std::string(line, S2Encoder::encode(0xABCDEF, data.data(), 4, line)) == "S208ABCDEF000D1A2742");
+	REQUIRE(std::string(line, S5Encoder::encode(3, nullptr, 0, line)) == "S5030003F9");
+	REQUIRE_THROWS_AS(S1Encoder::encode(0, data.data(), 253, line), std::invalid_argument);
+}
+
+TEST_CASE( "write_srec_parallel", "[SrecFile]") {
+	auto read_file = [](const std::string &name) {
+		std::ifstream f(name, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	};
+
+	std::vector<uint8_t> image(5 * 1024 * 1024 + 77);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = static_cast<uint8_t>(i * 31 + (i >> 12));
+	}
+
+	// same file as the sequential writer
+	for (size_t length : {size_t(0), size_t(1), size_t(250), size_t(100000), image.size()}) {
+		for (auto bits : {SrecFile::AddressSize::BITS16, SrecFile::AddressSize::BITS32}) {
+			{
+				SrecFile sf("test_sequential.srec", bits);
+				sf.reserve_crc_header();
+				sf.write_image(image.data(), length, 0);
+				sf.write_record_count();
+				sf.write_record_termination();
+				sf.write_crc_header(xcrc32(image.data(), length, 0));
+			}
+			ParallelWriteOptions options;
+			options.checksum = true;
+			options.threads = 3;
+			REQUIRE(write_srec_parallel("test_parallel_write.srec", bits, image.data(), length, options)
+			        == xcrc32(image.data(), length, 0));
+			REQUIRE(read_file("test_parallel_write.srec") == read_file("test_sequential.srec"));
+		}
+	}
+}
+
+TEST_CASE( "SrecFile::write_record", "[SrecFile]") {
+	const std::vector<uint8_t> data{0x01, 0x02, 0x03, 0x04};
+	{
+		SrecFile sf("test_record.srec", SrecFile::AddressSize::BITS32);
+		sf.set_crlf(true);
+		sf.write_record(SrecFile::AddressSize::BITS32, 0x20000000, data.data(), data.size());
+		sf.write_record(SrecFile::AddressSize::BITS16, 0x1000, data.data(), data.size());
+		sf.write_record(SrecFile::AddressSize::BITS24, 0x123456, data.data(), data.size());
+		REQUIRE_THROWS_AS(sf.write_record(SrecFile::AddressSize::BITS16, 0x10000, data.data(), data.size()), std::out_of_range);
+		sf.write_record_count();
+		sf.close();
+	}
+
+	std::ifstream f("test_record.srec", std::ios::binary);
+	std::string text(std::istreambuf_iterator<char>(f), {});
+	REQUIRE(text == Srec3(0x20000000, data).toString() + "\r\n"
+	              + Srec1(0x1000, data).toString() + "\r\n"
+	              + Srec2(0x123456, data).toString() + "\r\n"
+	              + Srec5(3).toString() + "\r\n");
+	std::remove("test_record.srec");
+}
+
+TEST_CASE( "SrecFile buffering", "[SrecFile]") {
+	SrecFile sf("test_buffer.srec", SrecFile::AddressSize::BITS16);
+	REQUIRE(sf.is_open());
+	REQUIRE_THROWS_AS(sf.set_buffer_size(16), std::invalid_argument);
+	sf.set_buffer_size(1024);
+	sf.set_sync_on_close(true);
+
+	std::vector<uint8_t> buffer(32, 0xAA);
+	for (int i = 0; i < 100; ++i) {
+		sf.write_record_payload(buffer);
+	}
+	sf.write_record_count();
+	sf.flush();
+
+	// everything written so far is visible after flush()
+	std::ifstream f("test_buffer.srec");
+	std::string line;
+	int lines = 0;
+	while (std::getline(f, line)) {
+		lines++;
+	}
+	REQUIRE(lines == 101);
+
+	sf.write_record_termination();
+	sf.close();
+	REQUIRE_FALSE(sf.is_open());
+	REQUIRE_THROWS_AS(sf.write_record_payload(buffer), std::ios_base::failure);
+}
+
+TEST_CASE( "SrecFile CRC header", "[SrecFile]") {
+	// patched in the buffer and, with a small buffer, in the file
+	for (size_t buffer_size : {SrecFile::DEFAULT_BUFFER_SIZE, size_t(1024)}) {
+		SrecFile sf("test_crc.srec", SrecFile::AddressSize::BITS32);
+		REQUIRE(sf.is_open());
+		REQUIRE(sf.seekable());
+		sf.set_buffer_size(buffer_size);
+		REQUIRE_THROWS_AS(sf.write_crc_header(0), std::logic_error);
+		sf.reserve_crc_header();
+		std::vector<uint8_t> buffer(64, 0x55);
+		for (int i = 0; i < 50; ++i) {
+			sf.write_record_payload(buffer);
+		}
+		sf.write_crc_header(0x12345678);
+		sf.close();
+
+		std::ifstream f("test_crc.srec");
+		std::string line;
+		std::getline(f, line);
+		REQUIRE(line == Srec0(std::vector<uint8_t>{0x12, 0x34, 0x56, 0x78, 0x00}).toString());
+		int lines = 1;
+		while (std::getline(f, line)) {
+			lines++;
+		}
+		REQUIRE(lines == 51);
+	}
+
+	// or appended, for streams
+	SrecFile sf("test_crc.srec", SrecFile::AddressSize::BITS16);
+	sf.write_crc_record(0x12345678);
+	sf.close();
+	std::ifstream f("test_crc.srec");
+	std::string line;
+	std::getline(f, line);
+	REQUIRE(line == Srec0(std::vector<uint8_t>{0x12, 0x34, 0x56, 0x78, 0x00}).toString());
+}
+
+TEST_CASE( "SrecFile write-behind", "[SrecFile]") {
+	std::vector<uint8_t> image(200000);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = static_cast<uint8_t>(i * 3 + (i >> 10));
+	}
+	auto write = [&](const std::string &filename, unsigned int depth) {
+		SrecFile sf(filename, SrecFile::AddressSize::BITS24);
+		sf.set_buffer_size(4096);
+		sf.set_io_depth(depth);
+		sf.reserve_crc_header();
+		sf.write_image(image.data(), image.size(), 0);
+		sf.write_record_count();
+		sf.write_record_termination();
+		sf.write_crc_header(xcrc32(image.data(), image.size(), 0));
+		sf.close();
+		std::ifstream f(filename, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	};
+	const std::string expected = write("test_aio.srec", 0);
+	REQUIRE(expected.size() > 400000);
+	REQUIRE(write("test_aio.srec", 4) == expected);
+	std::remove("test_aio.srec");
+}
+
+TEST_CASE( "WorkStealingPool", "[threadpool]") {
+	WorkStealingPool pool(3);
+	REQUIRE(pool.size() == 3);
+
+	// tasks submitted from tasks run on the same pool
+	std::vector<std::future<size_t>> outer;
+	for (size_t i = 0; i < 50; ++i) {
+		outer.push_back(pool.submit([&pool, i] {
+			std::vector<std::future<size_t>> inner;
+			for (size_t j = 0; j < 10; ++j) {
+				inner.push_back(pool.submit([i, j] { return i * 10 + j; }));
+			}
+			return inner.size();
+		}));
+	}
+	size_t tasks = 0;
+	for (auto &result : outer) {
+		tasks += result.get();
+	}
+	REQUIRE(tasks == 500);
+
+	auto failing = pool.submit([]() -> int { throw std::out_of_range("task failed"); });
+	REQUIRE_THROWS_AS(failing.get(), std::out_of_range);
+}
+
+TEST_CASE( "AsyncIo", "[aio]") {
+	std::vector<char> data(100000);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<char>(i * 7);
+	}
+
+	for (auto backend : {AsyncIo::Backend::Portable, AsyncIo::Backend::Auto}) {
+		AsyncIo io(4, backend);
+		REQUIRE(io.backend() != AsyncIo::Backend::Auto);
+		int fd = ::open("test_aio.bin", O_RDWR | O_CREAT | O_TRUNC, 0666);
+		REQUIRE(fd >= 0);
+		io.register_files({fd});
+		io.register_buffers({{data.data(), data.size()}});
+
+		// blocks written out of order land at their offsets
+		std::vector<AsyncIo::Completion> done;
+		for (size_t block : {3, 1, 0, 2}) {
+			io.write(fd, data.data() + block * 25000, 25000, block * 25000, block);
+		}
+		REQUIRE(io.full());
+		REQUIRE_THROWS_AS(io.write(fd, data.data(), 1, 0, 9), std::logic_error);
+		while (io.in_flight() > 0) {
+			io.wait(done);
+		}
+		REQUIRE(done.size() == 4);
+		for (const auto &completion : done) {
+			REQUIRE(completion.result == 25000);
+		}
+
+		// reads stop at the end of the file
+		std::vector<char> in(120000);
+		io.read(fd, in.data(), in.size(), 0, 7);
+		done.clear();
+		REQUIRE(io.wait(done) == 1);
+		REQUIRE(done[0].tag == 7);
+		REQUIRE(done[0].result == 100000);
+		REQUIRE(std::equal(data.begin(), data.end(), in.begin()));
+
+		// errors come back as -errno
+		io.read(-1, in.data(), 10, 0, 8);
+		done.clear();
+		io.wait(done);
+		REQUIRE(done[0].result == -EBADF);
+		::close(fd);
+	}
+
+	// whole files, in any order, with errors per file
+	std::vector<std::string> names{"test_aio.bin", "test_missing.bin", "test_aio.bin"};
+	std::vector<std::string> contents(names.size());
+	std::vector<bool> failed(names.size());
+	read_files(names, [&](size_t index, std::vector<char> &content, std::exception_ptr error) {
+		contents[index] = std::string(content.begin(), content.end());
+		failed[index] = error != nullptr;
+	}, 2);
+	REQUIRE(contents[0] == std::string(data.begin(), data.end()));
+	REQUIRE(contents[2] == contents[0]);
+	REQUIRE(failed[1]);
+	REQUIRE_FALSE(failed[0]);
+	std::remove("test_aio.bin");
+}
+
+TEST_CASE( "xcrc32", "[crc32]") {
+	std::vector<uint8_t> data(1000);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 131 + 7);
+	}
+
+	// check value of CRC-32/MPEG-2 (MSB first, no reflection, init all-ones, no final XOR)
+	const unsigned char check[] = "123456789";
+	REQUIRE(xcrc32(check, 9, 0xFFFFFFFF) == 0x0376E6E7);
+
+	for (unsigned int init : {0u, 0xFFFFFFFFu, 0x12345678u}) {
+		for (size_t len = 0; len <= data.size(); len += (len < 200 ? 1 : 7)) {
+			const unsigned int expected = xcrc32_bytewise(data.data(), len, init);
+			REQUIRE(xcrc32_slice8(data.data(), len, init) == expected);
+			REQUIRE(xcrc32_slice16(data.data(), len, init) == expected);
+			REQUIRE(xcrc32_clmul(data.data(), len, init) == expected);
+			REQUIRE(xcrc32(data.data(), len, init) == expected);
+		}
+	}
+}
+
+TEST_CASE( "crc32_combine", "[crc32]") {
+	std::vector<uint8_t> data(5 * 1024 * 1024);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>((i * 2654435761u) >> 13);
+	}
+	const unsigned int init = 0xFFFFFFFF;
+	const unsigned int whole = xcrc32(data.data(), data.size(), init);
+
+	for (size_t split : {size_t(0), size_t(1), size_t(1000), data.size() / 2, data.size()}) {
+		const unsigned int a = xcrc32(data.data(), split, init);
+		const unsigned int b = xcrc32(data.data() + split, data.size() - split, 0);
+		REQUIRE(crc32_combine(a, b, data.size() - split) == whole);
+	}
+
+	for (unsigned int threads : {0u, 1u, 3u, 4u}) {
+		REQUIRE(xcrc32_parallel(data.data(), data.size(), init, threads) == whole);
+	}
+
+	// patch 100 bytes in the middle and update without a rescan
+	std::vector<uint8_t> patched = data;
+	const size_t offset = 123456;
+	for (size_t i = 0; i < 100; ++i) {
+		patched[offset + i] ^= 0x5A;
+	}
+	REQUIRE(xcrc32_update(whole, &data[offset], &patched[offset], 100, data.size() - offset - 100)
+	        == xcrc32(patched.data(), patched.size(), init));
+}
+
+TEST_CASE( "SrecReader::parse_parallel", "[SrecReader]") {
+	std::vector<uint8_t> image(100000);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+	}
+	{
+		SrecFile sf("test_parallel.srec", SrecFile::AddressSize::BITS24);
+		sf.write_header(std::vector<uint8_t>{'H', 'D', 'R'});
+		std::vector<uint8_t> buffer(64);
+		for (size_t i = 0; i < image.size(); i += buffer.size()) {
+			buffer.assign(image.begin() + i, image.begin() + std::min(i + 64, image.size()));
+			sf.write_record_payload(buffer);
+		}
+		sf.write_record_count();
+		sf.write_record_termination();
+	}
+
+	for (unsigned int threads : {1u, 3u}) {
+		SrecReader reader("test_parallel.srec");
+		std::vector<uint8_t> data;
+		unsigned int crc = 0;
+		size_t next_line = 2; // line 1 is the header
+		size_t chunks = 0;
+		reader.parse_parallel([&](const SrecChunk &chunk) {
+			data.insert(data.end(), chunk.data.begin(), chunk.data.end());
+			crc = crc32_combine(crc, chunk.crc, chunk.data.size());
+			for (const auto &record : chunk.records) {
+				REQUIRE(record.line_number == next_line++);
+				REQUIRE(record.address == (record.line_number - 2) * 64);
+			}
+			chunks++;
+		}, threads, 4096);
+		REQUIRE(chunks > 10);
+		REQUIRE(data == image);
+		REQUIRE(crc == xcrc32(image.data(), image.size(), 0));
+	}
+
+	// errors report the line in the whole file
+	{
+		std::ofstream f("test_parallel.srec", std::ios::binary);
+		for (int i = 0; i < 1000; ++i) {
+			f << (i == 700 ? "S30D000000007F454C4G0101010396\n" : "S30D000000007F454C460101010396\n");
+		}
+	}
+	SrecReader reader("test_parallel.srec");
+	try {
+		reader.parse_parallel([](const SrecChunk &) {}, 3, 1024);
+		FAIL("no error reported");
+	} catch (const SrecError &err) {
+		REQUIRE(err.line_number() == 701);
+	}
+
+	// so do checksum errors, with their details
+	{
+		std::ofstream f("test_parallel.srec", std::ios::binary);
+		for (int i = 0; i < 1000; ++i) {
+			f << (i == 900 ? "S30D00000000FF454C460101010396\n" : "S30D000000007F454C460101010396\n");
+		}
+	}
+	SrecReader corrupt("test_parallel.srec");
+	try {
+		corrupt.parse_parallel([](const SrecChunk &) {}, 3, 1024);
+		FAIL("no error reported");
+	} catch (const SrecChecksumError &err) {
+		REQUIRE(err.line_number() == 901);
+		REQUIRE(err.expected() == 0x96);
+		REQUIRE(err.actual() == 0x16);
+	}
+}
+
+TEST_CASE( "SrecStream", "[SrecReader]") {
+	{
+		std::ofstream f("test_stream.srec", std::ios::binary);
+		f << "S00600004844521B\r\n";
+		for (unsigned int i = 0; i < 100; ++i) {
+			f << Srec1(i * 16, std::vector<uint8_t>(16, static_cast<uint8_t>(i))).toString() << "\r\n";
+		}
+		f << "\n"
+		  << "S503006498";
+	}
+
+	// a small block makes lines span block boundaries
+	SrecStream stream("test_stream.srec", 600);
+	SrecRecord record;
+	uint8_t data[SrecRecord::MAX_DATA_SIZE];
+	REQUIRE(stream.next(record));
+	REQUIRE(record.payload == "484452");
+	for (unsigned int i = 0; i < 100; ++i) {
+		REQUIRE(stream.next(record));
+		REQUIRE(record.address == i * 16);
+		REQUIRE(record.line_number == i + 2);
+		record.decode(data);
+		REQUIRE(data[15] == i);
+	}
+	REQUIRE(stream.next(record));
+	REQUIRE(record.type == Srec::Type::S5);
+	REQUIRE(record.line_number == 103);
+	REQUIRE_FALSE(stream.next(record));
+
+	REQUIRE_THROWS_AS(SrecStream("test_stream.srec", 16), std::invalid_argument);
+	{
+		std::ofstream f("test_stream.srec", std::ios::binary);
+		f << "S503006498\n" << std::string(1000, 'x') << "\n";
+	}
+	SrecStream long_lines("test_stream.srec", 600);
+	REQUIRE(long_lines.next(record));
+	REQUIRE_THROWS_AS(long_lines.next(record), SrecError);
+}
+
+TEST_CASE( "SrecStream::parse_parallel", "[SrecReader]") {
+	std::vector<uint8_t> image(50000);
+	for (size_t i = 0; i < image.size(); ++i) {
+		image[i] = static_cast<uint8_t>(i * 13 + (i >> 9));
+	}
+	{
+		SrecFile sf("test_stream.srec", SrecFile::AddressSize::BITS32);
+		sf.write_header(std::vector<uint8_t>{'H', 'D', 'R'});
+		sf.write_image(image.data(), image.size(), 0);
+		sf.write_record_count();
+		sf.write_record_termination();
+	}
+
+	for (unsigned int threads : {1u, 3u}) {
+		SrecStream stream("test_stream.srec", 1000);
+		// records already read with next() are not parsed again
+		SrecRecord record;
+		REQUIRE(stream.next(record));
+		REQUIRE(record.type == Srec::Type::S0);
+
+		std::vector<uint8_t> data;
+		size_t next_line = 2;
+		std::vector<std::string> others;
+		stream.parse_parallel([&](const SrecChunk &chunk) {
+			data.insert(data.end(), chunk.data.begin(), chunk.data.end());
+			for (const auto &r : chunk.records) {
+				REQUIRE(r.line_number == next_line++);
+			}
+			for (const auto &r : chunk.others) {
+				others.emplace_back(r.line);
+			}
+		}, threads);
+		REQUIRE(data == image);
+		REQUIRE(others.size() == 2);
+		REQUIRE(others[1] == "S70500000000FA");
+		REQUIRE_FALSE(stream.next(record));
+	}
+
+	// errors report the line in the whole input
+	{
+		std::ofstream f("test_stream.srec", std::ios::binary);
+		for (int i = 0; i < 1000; ++i) {
+			f << (i == 900 ? "S30D00000000FF454C460101010396\n" : "S30D000000007F454C460101010396\n");
+		}
+	}
+	SrecStream corrupt("test_stream.srec", 1000);
+	try {
+		corrupt.parse_parallel([](const SrecChunk &) {}, 3);
+		FAIL("no error reported");
+	} catch (const SrecChecksumError &err) {
+		REQUIRE(err.line_number() == 901);
+	}
+}
+
+TEST_CASE( "BlockPipeline", "[pipeline]") {
+	SpscRing<int> ring(3);
+	REQUIRE(ring.capacity() == 4);
+	for (int i = 0; i < 4; ++i) {
+		REQUIRE(ring.try_push(i));
+	}
+	int value = 99;
+	REQUIRE_FALSE(ring.try_push(value));
+	for (int i = 0; i < 4; ++i) {
+		REQUIRE(ring.try_pop(value));
+		REQUIRE(value == i);
+	}
+	REQUIRE_FALSE(ring.try_pop(value));
+
+	std::string text;
+	for (int i = 0; i < 5000; ++i) {
+		text += std::to_string(i) + "\n";
+	}
+	{
+		std::ofstream f("test_pipeline.txt", std::ios::binary);
+		f << text.substr(50);
+	}
+
+	using Pipeline = BlockPipeline<std::string>;
+	for (unsigned int workers : {1u, 4u}) {
+		// blocks of whole lines arrive in input order, prefix first
+		FILE *file = std::fopen("test_pipeline.txt", "rb");
+		REQUIRE(file != nullptr);
+		std::string out;
+		uint64_t expected_offset = 0;
+		Pipeline lines(64, Pipeline::Split::Lines, workers);
+		lines.run(fileno(file), std::string_view(text).substr(0, 50),
+		          [](const char *data, size_t length, uint64_t offset) {
+			return std::to_string(offset) + ":" + std::string(data, length);
+		}, [&](std::string &block) {
+			const size_t colon = block.find(':');
+			REQUIRE(block.size() - colon - 1 <= 64);
+			REQUIRE(block.back() == '\n');
+			REQUIRE(std::stoull(block.substr(0, colon)) == expected_offset);
+			expected_offset += block.size() - colon - 1;
+			out += block.substr(colon + 1);
+		});
+		std::fclose(file);
+		REQUIRE(out == text);
+
+		// errors of a worker are rethrown on the calling thread
+		file = std::fopen("test_pipeline.txt", "rb");
+		Pipeline bytes(100, Pipeline::Split::Bytes, workers);
+		size_t consumed = 0;
+		REQUIRE_THROWS_AS(bytes.run(fileno(file), {}, [](const char *, size_t, uint64_t offset) {
+			if (offset == 1000) {
+				throw std::out_of_range("bad block");
+			}
+			return std::string();
+		}, [&](std::string &) {
+			consumed++;
+		}), std::out_of_range);
+		std::fclose(file);
+		REQUIRE(consumed == 10);
+	}
+	std::remove("test_pipeline.txt");
+
+	// stages waiting on an idle pipe sleep instead of spinning
+	int fds[2];
+	REQUIRE(::pipe(fds) == 0);
+	ssize_t written = 0;
+	std::thread writer([&] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		written = ::write(fds[1], "late\n", 5);
+		::close(fds[1]);
+	});
+	auto cpu_time = [] {
+		timespec ts{};
+		::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+		return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+	};
+	const auto cpu_start = cpu_time();
+	Pipeline idle(100, Pipeline::Split::Lines, 4);
+	std::string out;
+	idle.run(fds[0], {}, [](const char *data, size_t length, uint64_t) {
+		return std::string(data, length);
+	}, [&](std::string &result) {
+		out += result;
+	});
+	writer.join();
+	::close(fds[0]);
+	REQUIRE(written == 5);
+	REQUIRE(out == "late\n");
+	REQUIRE(cpu_time() - cpu_start < std::chrono::milliseconds(100));
+}
+
+TEST_CASE( "SrecImage", "[SrecImage]") {
+	SrecImage image;
+	const std::vector<uint8_t> a = {1, 2, 3, 4};
+	const std::vector<uint8_t> b = {5, 6, 7, 8};
+
+	// sparse regions at both ends of the 32-bit address space
+	image.insert(0xFFFFFFFC, a);
+	image.insert(0x0, a);
+	image.insert(0x08000000, b);
+	REQUIRE(image.segments().size() == 3);
+	REQUIRE(image.size() == 12);
+	REQUIRE(image.min_address() == 0);
+	REQUIRE(image.max_address() == 0x100000000ULL);
+	REQUIRE_THROWS_AS(image.insert(0xFFFFFFFE, a), std::out_of_range);
+
+	// adjacent records are coalesced, in either order
+	image.insert(0x4, b);
+	image.insert(0x07FFFFFC, a);
+	REQUIRE(image.segments().size() == 3);
+	REQUIRE(image.segments()[0].data == std::vector<uint8_t>{1, 2, 3, 4, 5, 6, 7, 8});
+	REQUIRE(image.segments()[1].address == 0x07FFFFFC);
+	REQUIRE(image.segments()[1].data == std::vector<uint8_t>{1, 2, 3, 4, 5, 6, 7, 8});
+
+	// filling a gap joins the neighbours
+	image.insert(0x10, a);
+	image.insert(0x8, std::vector<uint8_t>(8, 9));
+	REQUIRE(image.segments().size() == 3);
+	REQUIRE(image.segments()[0].data.size() == 0x14);
+
+	// overlaps
+	REQUIRE(image.overlaps(0x13, 1));
+	REQUIRE_FALSE(image.overlaps(0x14, 0x100));
+	REQUIRE_THROWS_AS(image.insert(0x12, a), std::invalid_argument);
+	image.insert(0x12, a, SrecImage::Overlap::Replace);
+	REQUIRE(image.segments()[0].data.size() == 0x16);
+
+	// lookups
+	uint8_t out[4];
+	REQUIRE(image.read(0x08000000, out, 4));
+	REQUIRE(std::equal(out, out + 4, b.begin()));
+	REQUIRE_FALSE(image.read(0x08000002, out, 4));
+	REQUIRE(image.find(0x15) == &image.segments()[0]);
+	REQUIRE(image.find(0x16) == nullptr);
+	REQUIRE(image.find(0xFFFFFFFF) == &image.segments()[2]);
+
+	SrecImage other;
+	other.insert(0x16, b);
+	image.merge(other);
+	REQUIRE(image.segments()[0].data.size() == 0x1A);
+}
+
+TEST_CASE( "SrecImage out of order", "[SrecImage]") {
+	// 4 MiB in 16-byte records, too slow if every insert moved the image
+	constexpr unsigned int RECORDS = 0x40000;
+	std::vector<uint8_t> data(RECORDS * 16);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 13 + (i >> 8));
+	}
+	std::vector<unsigned int> order(RECORDS);
+	std::iota(order.begin(), order.end(), 0);
+
+	auto check = [&](const SrecImage &image) {
+		REQUIRE(image.segments().size() == 1);
+		REQUIRE(image.min_address() == 0x08000000);
+		REQUIRE(image.segments()[0].data == data);
+	};
+
+	SECTION("reverse") {
+		std::reverse(order.begin(), order.end());
+	}
+	SECTION("shuffled") {
+		std::shuffle(order.begin(), order.end(), std::mt19937(1));
+	}
+
+	SrecImage image;
+	for (unsigned int i : order) {
+		image.insert(0x08000000 + i * 16, data.data() + i * 16, 16);
+	}
+	check(image);
+
+	// overlaps with queued data are found before it is placed
+	SrecImage queued;
+	queued.insert(0x100, data.data(), 16);
+	queued.insert(0x80, data.data(), 16);
+	REQUIRE_THROWS_AS(queued.insert(0x88, data.data(), 4), std::invalid_argument);
+	REQUIRE_THROWS_AS(queued.insert(0x0, data.data(), 0x100), std::invalid_argument);
+
+	// later inserts win, also while queued
+	queued.insert(0x88, std::vector<uint8_t>(16, 0xAA), SrecImage::Overlap::Replace);
+	queued.insert(0x8C, std::vector<uint8_t>(2, 0xBB), SrecImage::Overlap::Replace);
+	REQUIRE(queued.segments().size() == 2);
+	REQUIRE(queued.segments()[0].data.size() == 0x18);
+	std::vector<uint8_t> expected(0x18, 0xAA);
+	std::copy(data.begin(), data.begin() + 8, expected.begin());
+	expected[0xC] = expected[0xD] = 0xBB;
+	REQUIRE(queued.segments()[0].data == expected);
+}
+
+TEST_CASE( "SrecImage::write_binary", "[SrecImage]") {
+	SrecImage image;
+	image.insert(0x1000, std::vector<uint8_t>{1, 2});
+	image.insert(0x1010, std::vector<uint8_t>{3});
+
+	auto read_file = [](const std::string &name) {
+		std::ifstream f(name, std::ios::binary);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	};
+
+	image.write_binary("test_image.bin", 0x1000, 0xFF);
+	std::vector<uint8_t> expected(0x11, 0xFF);
+	expected[0] = 1;
+	expected[1] = 2;
+	expected[0x10] = 3;
+	REQUIRE(read_file("test_image.bin") == expected);
+
+	// holes read back as zeros
+	image.write_binary("test_image.bin", 0xFFE);
+	expected.assign(0x13, 0);
+	expected[2] = 1;
+	expected[3] = 2;
+	expected[0x12] = 3;
+	REQUIRE(read_file("test_image.bin") == expected);
+
+	REQUIRE_THROWS_AS(image.write_binary("test_image.bin", 0x1001), std::invalid_argument);
+}
+
+TEST_CASE( "stream_binary", "[SrecImage]") {
+	auto read_file = [](const std::string &name) {
+		std::ifstream f(name, std::ios::binary);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	};
+	auto write_records = [](const std::vector<std::pair<unsigned int, std::vector<uint8_t>>> &records) {
+		std::ofstream f("test_stream_binary.srec", std::ios::binary);
+		for (const auto &record : records) {
+			f << Srec3(record.first, record.second).toString() << "\n";
+		}
+		f << Srec7(0).toString() << "\n";
+	};
+
+	write_records({{0x1000, {1, 2}}, {0x1010, {3}}});
+	{
+		SrecStream stream("test_stream_binary.srec");
+		stream_binary(stream, "test_stream.bin", std::nullopt, 0xFF);
+	}
+	std::vector<uint8_t> expected(0x11, 0xFF);
+	expected[0] = 1;
+	expected[1] = 2;
+	expected[0x10] = 3;
+	REQUIRE(read_file("test_stream.bin") == expected);
+
+	// holes read back as zeros
+	{
+		SrecStream stream("test_stream_binary.srec");
+		stream_binary(stream, "test_stream.bin", 0xFFE);
+	}
+	expected.assign(0x13, 0);
+	expected[2] = 1;
+	expected[3] = 2;
+	expected[0x12] = 3;
+	REQUIRE(read_file("test_stream.bin") == expected);
+
+	{
+		SrecStream stream("test_stream_binary.srec");
+		REQUIRE_THROWS_AS(stream_binary(stream, "test_stream.bin", 0x1001), SrecError);
+	}
+
+	// stdout appending to a file ('>> file') cannot leave holes by seeking
+	{
+		std::ofstream("test_stream.bin", std::ios::binary) << "ab";
+		const int saved = ::dup(STDOUT_FILENO);
+		const int fd = ::open("test_stream.bin", O_WRONLY | O_APPEND);
+		REQUIRE(fd >= 0);
+		std::fflush(stdout);
+		::dup2(fd, STDOUT_FILENO);
+		::close(fd);
+		SrecStream stream("test_stream_binary.srec");
+		stream_binary(stream, "-", 0xFFE);
+		::dup2(saved, STDOUT_FILENO);
+		::close(saved);
+	}
+	expected.insert(expected.begin(), {'a', 'b'});
+	REQUIRE(read_file("test_stream.bin") == expected);
+
+	// records must be in address order
+	write_records({{0x1000, {1, 2}}, {0x1001, {3}}});
+	SrecStream stream("test_stream_binary.srec");
+	try {
+		stream_binary(stream, "test_stream.bin", std::nullopt);
+		FAIL("no error reported");
+	} catch (const SrecError &err) {
+		REQUIRE(err.line_number() == 2);
+	}
+}
+
+TEST_CASE( "SrecIndex", "[SrecIndex]") {
+	std::vector<uint8_t> data(0x400);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 7);
+	}
+	std::remove("test_index.srec.sidx");
+	{
+		// records out of address order, with a gap at 0x200..0x210
+		std::ofstream f("test_index.srec", std::ios::binary);
+		f << Srec0(std::string("HDR")).toString() << "\r\n";
+		for (size_t address = 0x200; address < data.size(); address += 0x10) {
+			if (address != 0x200) {
+				f << Srec3(address, data.data() + address, 0x10).toString() << "\r\n";
+			}
+		}
+		for (size_t address = 0; address < 0x200; address += 0x20) {
+			f << Srec2(address, data.data() + address, 0x20).toString() << "\r\n";
+		}
+		f << Srec7(0).toString() << "\r\n";
+	}
+
+	std::vector<uint8_t> out(0x200);
+	{
+		SrecIndex index("test_index.srec");
+		REQUIRE_FALSE(index.from_sidecar());
+		REQUIRE(index.entries().size() == 0x10 + 0x1F);
+		REQUIRE(index.read(0x13, out.data(), 0x1E0));
+		REQUIRE(std::equal(out.begin(), out.begin() + 0x1E0, data.begin() + 0x13));
+		REQUIRE_FALSE(index.read(0x1F0, out.data(), 0x20));
+		REQUIRE(index.read(0x210, out.data(), 0x1F0));
+		REQUIRE(std::equal(out.begin(), out.begin() + 0x1F0, data.begin() + 0x210));
+		REQUIRE_FALSE(index.read(0x3FF, out.data(), 2));
+	}
+
+	SrecIndex index("test_index.srec");
+	REQUIRE(index.from_sidecar());
+	REQUIRE(index.read(0x3F0, out.data(), 0x10));
+	REQUIRE(std::equal(out.begin(), out.begin() + 0x10, data.begin() + 0x3F0));
+
+	// a record corrupted after indexing is reported at its line
+	std::string text;
+	{
+		std::ifstream f("test_index.srec", std::ios::binary);
+		text.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	}
+	const size_t second_line = text.find('\n') + 1;
+	text[second_line + 12] = text[second_line + 12] == '0' ? '1' : '0';
+	std::ofstream("test_index.srec", std::ios::binary) << text;
+	try {
+		index.read(0x210, out.data(), 0x10);
+		FAIL("no error reported");
+	} catch (const SrecError &err) {
+		REQUIRE(err.line_number() == 2);
+	}
+}
+
+TEST_CASE( "stats::allocations", "[stats]") {
+	// every form of operator new is counted and pairs with its delete
+	const uint64_t before = stats::allocations();
+	void *plain = ::operator new(16, std::nothrow);
+	void *array = ::operator new[](16);
+	void *array_nothrow = ::operator new[](16, std::nothrow);
+	void *aligned = ::operator new(16, std::align_val_t(64), std::nothrow);
+	void *aligned_array = ::operator new[](16, std::align_val_t(64));
+	REQUIRE(stats::allocations() - before == 5);
+	REQUIRE(plain != nullptr);
+	REQUIRE(array_nothrow != nullptr);
+	REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+	REQUIRE(reinterpret_cast<uintptr_t>(aligned_array) % 64 == 0);
+	::operator delete(plain, std::nothrow);
+	::operator delete[](array);
+	::operator delete[](array_nothrow, std::nothrow);
+	::operator delete(aligned, std::align_val_t(64), std::nothrow);
+	::operator delete[](aligned_array, 16, std::align_val_t(64));
+}
+
+TEST_CASE( "stats", "[stats]") {
+	{
+		std::ofstream f("test_stats.srec", std::ios::binary);
+		f << "S00600004844521B\nS107000001020304EE\nS9030000FC\n";
+	}
+
+	// Only recorded when compiled in, and then only between start() and stop()
+	const uint64_t expected = stats::compiled_in() ? 1 : 0;
+	stats::start();
+	SrecReader reader("test_stats.srec");
+	size_t records = 0;
+	reader.parse_parallel([&records](const SrecChunk &chunk) { records += chunk.records.size(); }, 1);
+	stats::stop();
+	SREC_STATS_ADD(Records, 1);
+	REQUIRE(records == 1);
+	REQUIRE(stats::count(stats::Counter::Records) == 3 * expected);
+	REQUIRE(stats::count(stats::Counter::Lines) == 3 * expected);
+	REQUIRE(stats::count(stats::Counter::BytesIn) == 47 * expected);
+	REQUIRE(stats::calls(stats::Phase::Read) == expected);
+	REQUIRE(stats::calls(stats::Phase::Decode) == expected);
+	REQUIRE(stats::calls(stats::Phase::Write) == 0);
+
+	std::ostringstream json;
+	stats::report(json, stats::Format::Json);
+	REQUIRE(json.str().find("\"records\":" + std::to_string(3 * expected)) != std::string::npos);
+	REQUIRE(json.str().find("\"decode\":{\"calls\":" + std::to_string(expected)) != std::string::npos);
+
+	// A trace has one event per timed phase, on the thread that ran it
+	stats::start(true);
+	{
+		SrecReader traced("test_stats.srec");
+		traced.parse_parallel([](const SrecChunk &) {}, 1);
+	}
+	stats::stop();
+	REQUIRE(stats::trace_events() == 3 * expected);
+	std::ostringstream trace;
+	stats::write_trace(trace);
+	REQUIRE(trace.str().rfind("{\"traceEvents\":[", 0) == 0);
+	REQUIRE((trace.str().find("\"name\":\"decode\",\"cat\":\"srec\",\"ph\":\"X\"") != std::string::npos) == stats::compiled_in());
+}
+
+#if defined(__linux__)
+TEST_CASE( "PerfCounters", "[PerfCounters]") {
+	REQUIRE(PerfCounters::hardware_events().size() == stats::PERF_EVENTS);
+
+	// Hardware counters are missing in many VMs, the software task clock is
+	// not unless perf_event_open() is blocked. An unknown event type fails
+	// on its own without taking the other counters down.
+	const std::vector<PerfCounters::Event> events{
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock"},
+		{0xFFFF, 0, "unknown"},
+	};
+	auto spin = [] {
+		const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+		while (std::chrono::steady_clock::now() < end) {
+		}
+	};
+
+	PerfCounters thread(events, PerfCounters::Scope::Thread);
+	REQUIRE_FALSE(thread.available(1));
+	REQUIRE_FALSE(thread.error().empty());
+	if (!thread.any_available()) {
+		return;
+	}
+	uint64_t before[2], after[2];
+	thread.read(before);
+	spin();
+	thread.read(after);
+	REQUIRE(after[0] > before[0] + 10000000);
+	REQUIRE(after[1] == 0);
+
+	// Threads started later count once they exit
+	PerfCounters process(events, PerfCounters::Scope::Process);
+	REQUIRE(process.available(0));
+	process.read(before);
+	std::thread(spin).join();
+	process.read(after);
+	REQUIRE(after[0] > before[0] + 10000000);
+}
+#endif
+
+TEST_CASE( "srecgen", "[srecgen]") {
+	auto run = [](const std::string &args, const std::string &output) {
+		return std::system((std::string(SREC_TOOLS_DIR) + "/srecgen " + args + " -o " + output).c_str());
+	};
+	auto read_file = [](const std::string &name) {
+		std::ifstream f(name, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	};
+
+	// the same seed and options give the same file
+	const std::string options = "--seed 42 --segments 5 --size 256K -r 16:245 --mixed --shuffle --crlf -c";
+	REQUIRE(run(options, "test_srecgen_a.srec") == 0);
+	REQUIRE(run(options, "test_srecgen_b.srec") == 0);
+	REQUIRE_FALSE(read_file("test_srecgen_a.srec").empty());
+	REQUIRE(read_file("test_srecgen_a.srec") == read_file("test_srecgen_b.srec"));
+	REQUIRE(run("--seed 43 --segments 5 --size 256K -r 16:245 --mixed --shuffle --crlf -c", "test_srecgen_b.srec") == 0);
+	REQUIRE(read_file("test_srecgen_a.srec") != read_file("test_srecgen_b.srec"));
+
+	// the default size fits small address spaces
+	REQUIRE(run("-b 16", "test_srecgen_a.srec") == 0);
+	{
+		SrecReader reader("test_srecgen_a.srec");
+		SrecImage image;
+		image.load(reader);
+		REQUIRE(image.size() == 0x10000);
+	}
+	REQUIRE(run("-b 16 --segments 4", "test_srecgen_a.srec") == 0);
+
+	std::remove("test_srecgen_a.srec");
+	std::remove("test_srecgen_b.srec");
+}